@@ -1,11 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <functional>
 #include <fstream>
 #include <iostream>
 #include <limits>       // std::numeric_limits
 #include <filesystem>
 #include <memory>
+#include <numeric>
+#include <tuple>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
 #include <pybind11/pybind11.h>
 #include "xtensor/xview.hpp"
 #include "xtensor/xnorm.hpp"
@@ -15,6 +23,11 @@
 #include "reneu/type_aliase.hpp"
 #include "reneu/utils/math.hpp"
 #include "reneu/utils/kd_tree.hpp"
+#include "reneu/utils/parallel.hpp"
+#include "reneu/utils/simd.hpp"
+#include "reneu/utils/npy.hpp"
+#include "reneu/utils/morton.hpp"
+#include "reneu/utils/nearest_point_grid.hpp"
 
 // use the c++17 nested namespace
 namespace reneu{
@@ -22,10 +35,109 @@ namespace reneu{
 
 namespace py = pybind11;
 
+using ScoreSumKernel = float (*)(const float *table, const float *squaredDistThresholds, 
+                                    const float *squaredDists, const float *absoluteDotProducts,
+                                    const std::size_t pointNum);
+
+/**
+ * \brief the flat index of score table. 
+ * The bins are found by counting the thresholds without any branch.
+ */
+template<Index DistBinNum, Index AdpBinNum>
+inline Index score_table_index(const float *squaredDistThresholds, 
+                                const float &squaredDist, const float &adp){
+    Index distIdx = 0;
+    for (Index i=0; i<DistBinNum-1; i++){
+        distIdx += (squaredDist >= squaredDistThresholds[i]);
+    }
+    // minus a small value to make sure that adp=1, we get the last bin rather than out of table.
+    // subtract before multiply, so the compiler can not fuse them and round differently.
+    const Index adpIdx = std::min( 
+            static_cast<Index>(std::max((adp - 1e-5f) * AdpBinNum, 0.f)), AdpBinNum - 1 );
+    return distIdx * AdpBinNum + adpIdx;
+}
+
+template<Index DistBinNum, Index AdpBinNum>
+inline float score_sum_scalar(const float *table, const float *squaredDistThresholds, 
+                                const float *squaredDists, const float *absoluteDotProducts,
+                                const std::size_t pointNum){
+    float sum = 0;
+    for (std::size_t i=0; i<pointNum; i++){
+        sum += table[ score_table_index<DistBinNum, AdpBinNum>( 
+                        squaredDistThresholds, squaredDists[i], absoluteDotProducts[i] ) ];
+    }
+    return sum;
+}
+
+#ifdef RENEU_X86_SIMD
+// compute the bins of 8 points and gather their scores at once
+template<Index DistBinNum, Index AdpBinNum>
+__attribute__((target("avx2,fma")))
+inline float score_sum_avx2(const float *table, const float *squaredDistThresholds, 
+                                const float *squaredDists, const float *absoluteDotProducts,
+                                const std::size_t pointNum){
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 adpScale = _mm256_set1_ps(AdpBinNum);
+    const __m256 adpOffset = _mm256_set1_ps(1e-5f);
+    const __m256i maxAdpIdx = _mm256_set1_epi32(AdpBinNum - 1);
+    const __m256i adpBinNum = _mm256_set1_epi32(AdpBinNum);
+    __m256 sum = zero;
+    std::size_t i = 0;
+    for (; i+8<=pointNum; i+=8){
+        const __m256 squaredDist = _mm256_loadu_ps(squaredDists + i);
+        __m256i distIdx = _mm256_setzero_si256();
+        for (Index j=0; j<DistBinNum-1; j++){
+            // the mask of true is -1 
+            const __m256 mask = _mm256_cmp_ps(squaredDist, 
+                                _mm256_set1_ps(squaredDistThresholds[j]), _CMP_GE_OQ);
+            distIdx = _mm256_sub_epi32(distIdx, _mm256_castps_si256(mask));
+        }
+        // the same order of operations with the scalar kernel to get the same bins
+        const __m256 adp = _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps(
+                    _mm256_loadu_ps(absoluteDotProducts + i), adpOffset), adpScale), zero);
+        const __m256i adpIdx = _mm256_min_epi32(_mm256_cvttps_epi32(adp), maxAdpIdx);
+        const __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(distIdx, adpBinNum), adpIdx);
+        sum = _mm256_add_ps(sum, _mm256_i32gather_ps(table, index, 4));
+    }
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, sum);
+    float total = 0;
+    for (Index j=0; j<8; j++){
+        total += lanes[j];
+    }
+    return total + score_sum_scalar<DistBinNum, AdpBinNum>( table, squaredDistThresholds, 
+                        squaredDists + i, absoluteDotProducts + i, pointNum - i);
+}
+#endif
+
+inline bool has_score_sum_avx2(){
+#ifdef RENEU_X86_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+}
+
+template<Index DistBinNum, Index AdpBinNum>
+inline ScoreSumKernel select_score_sum_kernel(){
+#ifdef RENEU_X86_SIMD
+    if (has_score_sum_avx2()){
+        return score_sum_avx2<DistBinNum, AdpBinNum>;
+    }
+#endif
+    return score_sum_scalar<DistBinNum, AdpBinNum>;
+}
+
 class ScoreTable{
 
+public:
+    // the number of distance and absolute dot product bins
+    static constexpr Index DIST_BIN_NUM = 21;
+    static constexpr Index ADP_BIN_NUM = 10;
+
 private:
-    xt::xtensor_fixed<float, xt::xshape<21, 10>> table; 
+    xt::xtensor_fixed<float, xt::xshape<DIST_BIN_NUM, ADP_BIN_NUM>> table; 
     //const DistThresholdsType distThresholds = {0., 0.75, 1.5, 2, 2.5, 3, 3.5, 4, 5, 6, 7, 8, 9, 10, 
     //                                    12, 14, 16, 20, 25, 30, 40, std::numeric_limits<float>::max()};
     // this is using nanometer rather than micron
@@ -38,36 +150,14 @@ private:
     // const xt::xtensor_fixed<float, xt::xshape<11>> adpThresholds = {
             // -1, 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 2};
 
-    template<std::size_t N>
-    inline auto binary_search( const xt::xtensor_fixed<float, xt::xshape<N>> &thresholds, 
-                                                        const float &value ) const {
-        Index start = 0;
-        // Note that the last one index is N-1 rather than N_
-        // This is following python indexing style, the last index is not inclusive
-        Index stop = N;
-        while( stop - start > 1 ){
-            auto middle = std::div(stop - start, 2).quot + start;
-            if ( value >= thresholds[ middle ] ){
-                // Move forward
-                start = middle;
-            }else{
-                // Move backward
-                stop = middle;
-            }
+    // the upper bounds of distance bins except the last one, squared to avoid sqrt of distances
+    const std::array<float, DIST_BIN_NUM-1> squaredDistThresholds = [this](){
+        std::array<float, DIST_BIN_NUM-1> squaredThresholds;
+        for (Index i=0; i<DIST_BIN_NUM-1; i++){
+            squaredThresholds[i] = distThresholds(i+1) * distThresholds(i+1);
         }
-        // the start is the matching index
-        return start;
-    }
-    
-    template<std::size_t N>
-    inline auto sequential_search( const xt::xtensor_fixed<float, xt::xshape<N>> &thresholds, 
-                                                        const float &value ) const {
-        for (Index i=0; i<N; i++){
-            if(value < thresholds(i+1)){
-                return i;
-            }
-        }
-    }
+        return squaredThresholds;
+    }();
 
 public:
     ScoreTable(const xt::pytensor<float, 2> &table_): table(table_){}
@@ -97,18 +187,50 @@ public:
      * \param dp: absolute dot product of vectors
      */
     inline auto operator()(const float &dist, const float &adp) const {
-        // Index distIdx = sequential_search( distThresholds, dist );
-        Index distIdx = binary_search( distThresholds, dist );
+        return table.data()[ score_table_index<DIST_BIN_NUM, ADP_BIN_NUM>( 
+                                        squaredDistThresholds.data(), dist * dist, adp ) ];
+    }
 
-        // minus a small value to make sure that adp=1, we get index 9 rather than 10
-        Index adpIdx = trunc( adp * 10. - 1e-4 );
-        // Index adpIdx1 = binary_search( adpThresholds, adp );
-        // Index adpIdx2 = sequential_search( adpThresholds, adp );
+    /**
+     * \brief the sum of scores of a batch of point pairs.
+     * \param squaredDists: the squared physical distances
+     * \param absoluteDotProducts: the absolute dot products of vectors
+     */
+    inline float sum(const float *squaredDists, const float *absoluteDotProducts, 
+                                                const std::size_t &pointNum) const {
+        // the cpu is only checked once
+        static const ScoreSumKernel kernel = 
+                                select_score_sum_kernel<DIST_BIN_NUM, ADP_BIN_NUM>();
+        return kernel( table.data(), squaredDistThresholds.data(), 
+                        squaredDists, absoluteDotProducts, pointNum );
+    }
 
-        // if (adpIdx != adpIdx2){
-            // std::cout<< adp << ": inconsistent adpidx: " << adpIdx << ", " << adpIdx1 << ", " << adpIdx2 << std::endl;
-        // }
-        return table( distIdx, adpIdx );
+    /**
+     * \brief the sum of scores with a chosen kernel, to check the kernels against each other.
+     * \param kernel: "scalar", "avx2" or "auto" for the one used by sum
+     */
+    inline float py_sum(const xt::pytensor<float, 1> &squaredDists, 
+                        const xt::pytensor<float, 1> &absoluteDotProducts,
+                        const std::string &kernel) const {
+        if (squaredDists.size() != absoluteDotProducts.size()){
+            throw std::runtime_error("the distances and dot products should have the same size.");
+        }
+        // the pytensor could be a strided view of numpy array
+        const std::vector<float> dists(squaredDists.begin(), squaredDists.end());
+        const std::vector<float> adps(absoluteDotProducts.begin(), absoluteDotProducts.end());
+        if (kernel == "auto"){
+            return sum(dists.data(), adps.data(), dists.size());
+        } else if (kernel == "scalar"){
+            return score_sum_scalar<DIST_BIN_NUM, ADP_BIN_NUM>( table.data(), 
+                    squaredDistThresholds.data(), dists.data(), adps.data(), dists.size() );
+        }
+#ifdef RENEU_X86_SIMD
+        if (kernel == "avx2" && has_score_sum_avx2()){
+            return score_sum_avx2<DIST_BIN_NUM, ADP_BIN_NUM>( table.data(), 
+                    squaredDistThresholds.data(), dists.data(), adps.data(), dists.size() );
+        }
+#endif
+        throw std::runtime_error("unsupported score sum kernel: " + kernel);
     }
 
     inline auto operator()(const std::tuple<float, float> &slice){
@@ -119,158 +241,987 @@ public:
         return table(0, 9);
     }
 
+    // the best score that a single query point could get
+    auto max_score() const {
+        return *std::max_element(table.begin(), table.end());
+    }
+
+    /*
+     * the query points farther than this distance all fall in the last row of table.
+     */
+    inline auto far_distance() const {
+        return distThresholds(DIST_BIN_NUM-1);
+    }
+
+    // the best score that a far away query point could get
+    auto max_far_score() const {
+        return *std::max_element(table.begin() + (DIST_BIN_NUM-1) * ADP_BIN_NUM, table.end());
+    }
+
 }; // ScoreTable class 
 
+// the dual tree search pays off only when both clouds are large
+const Index DUAL_TREE_MIN_POINT_NUM = 4096;
+
+// the number of query points scored in a batch of table lookup
+const Index SCORE_CHUNK_SIZE = 64;
+
+/*
+ * the memory of a vector cloud built in this process.
+ */
+struct VectorCloudBuffers{
+    // N x 3 in C order
+    std::vector<float> points;
+    std::vector<float> vectors;
+    // the input index of each stored point, empty if they are in input order
+    std::vector<Index> pointIndices;
+};
+
 class VectorCloud{
 
 private:
-    const Points points;
-    xt::xtensor<float, 2> vectors;
+    Index pointNum;
+    // the owner of memory, either the buffers built here or a memory mapped library
+    std::shared_ptr<const void> storage;
+    // N x 3 in C order
+    const float *points;
+    const float *vectors;
+    // the input index of each stored point, nullptr if they are in input order
+    const Index *pointIndices;
     KDTree kdTree;
-    auto construct_vectors(const Index &nearestPointNum){
-        auto pointNum = points.shape(0);
-        
-        // find the nearest k points and compute the first principle component as the main direction
-        xt::xtensor<float, 2>::shape_type shape = {nearestPointNum, 3};
-        Points nearestPoints = xt::empty<float>(shape);
+    // an optional index for the targets queried many times, shared by the copies
+    std::shared_ptr<const NearestPointGrid> nearestPointGrid;
+
+    /*
+     * \param points_: only the first 3 columns are used
+     * \param order: the input index of each stored point, empty to keep the input order
+     */
+    static auto make_buffers(const Points &points_, const std::vector<Index> &order){
+        auto buffers = std::make_shared<VectorCloudBuffers>();
+        const Index pointNum_ = points_.shape(0);
+        if (!order.empty() && order.size() != pointNum_){
+            throw std::runtime_error("the point indices do not match the points.");
+        }
+        buffers->points.resize( 3 * pointNum_ );
+        buffers->vectors.resize( 3 * pointNum_ );
+        buffers->pointIndices = order;
+        for (Index pointIdx = 0; pointIdx < pointNum_; pointIdx++){
+            const Index inputIdx = order.empty() ? pointIdx : order[ pointIdx ];
+            for (Index dim=0; dim<3; dim++){
+                buffers->points[ 3*pointIdx + dim ] = points_( inputIdx, dim );
+            }
+        }
+        return buffers;
+    }
 
-        xt::xtensor<float, 2>::shape_type vshape = {pointNum, 3};
-        vectors = xt::empty<float>( vshape );
+    // the stored points as a tensor to build the tree
+    static auto make_points(const VectorCloudBuffers &buffers){
+        Points::shape_type sh = {buffers.points.size() / 3, 3};
+        Points points_ = xt::empty<float>(sh);
+        std::copy(buffers.points.begin(), buffers.points.end(), points_.begin());
+        return points_;
+    }
 
+    void set_buffers(const std::shared_ptr<VectorCloudBuffers> &buffers){
+        pointNum = buffers->points.size() / 3;
+        points = buffers->points.data();
+        vectors = buffers->vectors.data();
+        pointIndices = buffers->pointIndices.empty() ? nullptr : buffers->pointIndices.data();
+        storage = buffers;
+    }
+
+    /*
+     * \param buffers: the points in Morton order
+     */
+    VectorCloud( const std::shared_ptr<VectorCloudBuffers> &buffers, const Index &leafSize, 
+                    const Index &nearestPointNum, const std::size_t &threadNum ): 
+                        kdTree(make_points(*buffers), leafSize, threadNum){
+        set_buffers( buffers );
+        construct_vectors( make_points(*buffers), nearestPointNum, buffers->vectors, threadNum );
+    }
+
+    /*
+     * copy the stored N x 3 array to input order
+     */
+    auto to_input_order(const float *array) const {
+        PyPoints::shape_type sh = {pointNum, 3};
+        PyPoints pyArray = xt::empty<float>(sh);
         for (Index pointIdx = 0; pointIdx < pointNum; pointIdx++){
-            xt::xtensor<float, 1> queryPoint = xt::view(points, pointIdx, xt::range(0, 3));
-            auto nearestPointIndices = kdTree.knn( queryPoint, nearestPointNum );
-            // std::cout<< "nearest point indices: " << nearestPointIndices << std::endl;
-            for (Index i=0; i<nearestPointIndices.size(); i++){
-                auto nearestPointIndex = nearestPointIndices(i);
-                nearestPoints(i, 0) = points( nearestPointIndex, 0 );
-                nearestPoints(i, 1) = points( nearestPointIndex, 1 );
-                nearestPoints(i, 2) = points( nearestPointIndex, 2 );
-            }
-            // use the first principle component as the main direction
-            //vectors(pointIdx, xt::all()) = pca_first_component( nearestPoints ); 
-            // std::cout<< "nearest points: " << nearestPoints << std::endl;
-            auto direction = pca_first_component( nearestPoints );
-            vectors(pointIdx, 0) = direction(0);
-            vectors(pointIdx, 1) = direction(1);
-            vectors(pointIdx, 2) = direction(2);
-            // std::cout<< "vector: " << direction << std::endl;
+            const Index inputIdx = pointIndices ? pointIndices[ pointIdx ] : pointIdx;
+            std::copy(array + 3*pointIdx, array + 3*pointIdx + 3, pyArray.data() + 3*inputIdx);
         }
+        return pyArray;
+    }
+
+    void construct_vectors(const Points &points_, const Index &nearestPointNum, 
+                            std::vector<float> &vectors_, const std::size_t &threadNum){
+        // query all the points in one batch 
+        const auto nearestPointIndices = kdTree.knn_batch( points_, nearestPointNum, threadNum );
+
+        // use the first principle component of the nearest k points as the main direction.
+        // it is the principal eigenvector of their 3x3 covariance matrix.
+        utils::parallel_for( pointNum, [&](const std::size_t &pointIdx){
+            double mean[3] = {0., 0., 0.};
+            for (Index i=0; i<nearestPointNum; i++){
+                const Index nearestPointIndex = nearestPointIndices(pointIdx, i);
+                for (Index dim=0; dim<3; dim++){
+                    mean[dim] += points[ 3*nearestPointIndex + dim ];
+                }
+            }
+            for (Index dim=0; dim<3; dim++){
+                mean[dim] /= nearestPointNum;
+            }
+
+            // the upper triangle of covariance matrix
+            double covariance[6] = {0., 0., 0., 0., 0., 0.};
+            for (Index i=0; i<nearestPointNum; i++){
+                const float *nearestPoint = points + 3*nearestPointIndices(pointIdx, i);
+                const double dx = nearestPoint[0] - mean[0];
+                const double dy = nearestPoint[1] - mean[1];
+                const double dz = nearestPoint[2] - mean[2];
+                covariance[0] += dx*dx;
+                covariance[1] += dx*dy;
+                covariance[2] += dx*dz;
+                covariance[3] += dy*dy;
+                covariance[4] += dy*dz;
+                covariance[5] += dz*dz;
+            }
+
+            utils::principal_eigenvector_3x3( covariance, vectors_.data() + 3*pointIdx );
+        }, threadNum, 1024);
     }
 
 public:
-    VectorCloud( const Points &points_, const Points &vectors_, const KDTree &kdTree_ ):
-                points(points), vectors(vectors_), kdTree(kdTree_){}
+    /*
+     * \param points_, vectors_: in input order
+     * \param kdTree_: built with the stored points
+     * \param pointIndices_: the input index of each stored point, empty if they are the same
+     */
+    VectorCloud( const Points &points_, const Points &vectors_, const KDTree &kdTree_, 
+                    const std::vector<Index> &pointIndices_ = {} ): kdTree(kdTree_){
+        auto buffers = make_buffers( points_, pointIndices_ );
+        for (Index pointIdx = 0; pointIdx < points_.shape(0); pointIdx++){
+            const Index inputIdx = pointIndices_.empty() ? pointIdx : pointIndices_[ pointIdx ];
+            for (Index dim=0; dim<3; dim++){
+                buffers->vectors[ 3*pointIdx + dim ] = vectors_( inputIdx, dim );
+            }
+        }
+        set_buffers( buffers );
+    }
     
-    VectorCloud( const PyPoints &points_, const PyPoints &vectors_, const KDTree &kdTree_ ):
-                points(points), vectors(vectors_), kdTree(kdTree_){}
+    VectorCloud( const PyPoints &points_, const PyPoints &vectors_, const KDTree &kdTree_, 
+                    const std::vector<Index> &pointIndices_ = {} ):
+                VectorCloud( Points(points_), Points(vectors_), kdTree_, pointIndices_ ){}
     
     // our points array contains radius direction, but we do not need it.
+    // the points are stored in Morton order, so the consecutive points are 
+    // close in space, and their nearest neighbor searches walk the same tree nodes.
+    // threadNum: the number of threads, 0 means all the hardware threads.
     VectorCloud( const Points &points_, const Index &leafSize, 
-                    const Index &nearestPointNum ): 
-                    points(points_), kdTree(points_, leafSize){
-        construct_vectors( nearestPointNum );
-    }
+                    const Index &nearestPointNum, const std::size_t &threadNum = 0 ): 
+        VectorCloud( make_buffers(points_, utils::morton_order(points_)), 
+                                                leafSize, nearestPointNum, threadNum ){}
     
     VectorCloud( const xt::pytensor<float, 2> &points_, const Index &leafSize, 
-                        const Index &nearestPointNum ): 
-                        points(points_), kdTree(points_, leafSize) {
-        construct_vectors( nearestPointNum );
-    }
+                        const Index &nearestPointNum, const std::size_t &threadNum = 0 ): 
+                        VectorCloud( Points(points_), leafSize, nearestPointNum, threadNum ){}
 
+    /*
+     * a view of points and vectors owned by others, such as a memory mapped library.
+     * \param points_, vectors_: N x 3 in C order
+     * \param pointIndices_: the input index of each point, nullptr if not reordered
+     */
+    VectorCloud( const Index &pointNum_, const float *points_, const float *vectors_, 
+                    const KDTree &kdTree_, const std::shared_ptr<const void> &owner, 
+                    const Index *pointIndices_ = nullptr ): 
+        pointNum(pointNum_), storage(owner), points(points_), vectors(vectors_), 
+        pointIndices(pointIndices_), kdTree(kdTree_){}
     
     inline auto size() const {
-        return points.shape(0);
+        return pointNum;
     }
 
-    inline auto get_points() const {
+    // N x 3 in C order, in the stored order
+    inline const float* get_points() const {
         return points;
     }
 
+    // in input order
     inline auto get_py_points() const {
-        return PyPoints(points);
+        return to_input_order( points );
     }
 
-    inline auto get_vectors() const {
+    // N x 3 in C order, in the stored order
+    inline const float* get_vectors() const {
         return vectors;
     }
 
+    // in input order
     inline auto get_py_vectors() const {
-        return PyPoints( vectors );
+        return to_input_order( vectors );
     }
 
-    inline auto get_kd_tree() const {
+    // the input index of each stored point, nullptr if they are in input order
+    inline const Index* get_point_indices() const {
+        return pointIndices;
+    }
+
+    inline auto get_py_point_indices() const {
+        std::vector<Index> pointIndices_( pointNum );
+        if (pointIndices){
+            std::copy(pointIndices, pointIndices + pointNum, pointIndices_.begin());
+        } else {
+            std::iota(pointIndices_.begin(), pointIndices_.end(), 0);
+        }
+        return pointIndices_;
+    }
+
+    inline const auto& get_kd_tree() const {
         return kdTree;
     }
 
+    /*
+     * \brief precompute the nearest point of every cell within the far distance 
+     * of score table, then query_by looks up the grid rather than walking the tree.
+     * The distance of a looked up point is at most one cell diagonal longer than the
+     * nearest neighbor, so the resolution should be much smaller than the distance bins.
+     * The query points beyond the far distance still search the tree.
+     * The grid is not serialized, only its resolution and max distance are pickled, 
+     * and it is rebuilt after unpickling.
+     */
+    void build_nearest_point_grid(const float &resolution, const ScoreTable &scoreTable, 
+                                                        const std::size_t &threadNum = 0){
+        build_nearest_point_grid( resolution, scoreTable.far_distance(), threadNum );
+    }
+
+    /*
+     * \param maxDistance: the cells are complete within this distance to the points
+     */
+    void build_nearest_point_grid(const float &resolution, const float &maxDistance, 
+                                                        const std::size_t &threadNum = 0){
+        nearestPointGrid = std::make_shared<const NearestPointGrid>( 
+                    kdTree, points, resolution, maxDistance, threadNum );
+    }
+
+    inline bool has_nearest_point_grid() const {
+        return nearestPointGrid != nullptr;
+    }
+
+    inline const auto& get_nearest_point_grid() const {
+        return nearestPointGrid;
+    }
+
     inline auto get_kd_tree_serializable_tuple() const {
         return kdTree.get_serializable_tuple();
     } 
 
+    static inline float dot_product(const float *vector1, const float *vector2){
+        return vector1[0]*vector2[0] + vector1[1]*vector2[1] + vector1[2]*vector2[2];
+    }
+
+    static inline float squared_distance(const float *point1, const float *point2){
+        const float dx = point1[0] - point2[0];
+        const float dy = point1[1] - point2[1];
+        const float dz = point1[2] - point2[2];
+        return dx*dx + dy*dy + dz*dz;
+    }
+
     float query_by_self(const ScoreTable &scoreTable) const {
         return size() * scoreTable.self_score();
     }
 
-    auto query_by(const VectorCloud &query, const ScoreTable &scoreTable) const {
+    /*
+     * \brief the same with query_by, but find all the nearest neighbors 
+     * with one dual tree walk of query and target trees.
+     */
+    float query_by_dual_tree(const VectorCloud &query, const ScoreTable &scoreTable, 
+                    const float &cutoff = std::numeric_limits<float>::lowest()) const {
+        const auto [nearestPointIndices, squaredDists] = 
+                                    kdTree.dual_tree_nearest_neighbors( query.kdTree );
+
+        float rawScore = 0;
+        const float maxPointScore = scoreTable.max_score();
+        const Index queryPointNum = query.size();
+        const float *queryVectors = query.get_vectors();
+        std::array<float, SCORE_CHUNK_SIZE> absoluteDotProducts;
+        for (Index chunkStart = 0; chunkStart<queryPointNum; chunkStart += SCORE_CHUNK_SIZE){
+            const float upperBound = rawScore + (queryPointNum - chunkStart) * maxPointScore;
+            if (upperBound < cutoff){
+                return upperBound;
+            }
+            const Index chunkSize = std::min(SCORE_CHUNK_SIZE, queryPointNum - chunkStart);
+            for (Index i=0; i<chunkSize; i++){
+                const Index queryPointIndex = chunkStart + i;
+                const Index nearestPointIndex = nearestPointIndices( queryPointIndex );
+                absoluteDotProducts[i] = std::abs( dot_product( 
+                        queryVectors + 3*queryPointIndex, vectors + 3*nearestPointIndex ) );
+            }
+            rawScore += scoreTable.sum( squaredDists.data() + chunkStart, 
+                                        absoluteDotProducts.data(), chunkSize );
+        }
+        return rawScore;
+    }
+
+    /*
+     * \brief the same with query_by, but find the nearest neighbors in the grid.
+     */
+    float query_by_grid(const VectorCloud &query, const ScoreTable &scoreTable, 
+                    const float &maxPointScore, const float &cutoff) const {
+        float rawScore = 0;
+        const Index queryPointNum = query.size();
+        const float *queryPoints = query.get_points();
+        const float *queryVectors = query.get_vectors();
+        std::array<float, SCORE_CHUNK_SIZE> squaredDists, absoluteDotProducts;
+        for (Index chunkStart = 0; chunkStart<queryPointNum; chunkStart += SCORE_CHUNK_SIZE){
+            const float upperBound = rawScore + (queryPointNum - chunkStart) * maxPointScore;
+            if (upperBound < cutoff){
+                return upperBound;
+            }
+            const Index chunkSize = std::min(SCORE_CHUNK_SIZE, queryPointNum - chunkStart);
+            for (Index i=0; i<chunkSize; i++){
+                const Index queryPointIndex = chunkStart + i;
+                const float *queryPoint = queryPoints + 3*queryPointIndex;
+                Index nearestPointIndex = nearestPointGrid->find( queryPoint );
+                if (nearestPointIndex == GRID_EMPTY_CELL){
+                    // too far to be in the grid
+                    std::tie(nearestPointIndex, squaredDists[i]) = 
+                                                kdTree.nearest_neighbor( queryPoint );
+                } else {
+                    squaredDists[i] = squared_distance( 
+                                            queryPoint, points + 3*nearestPointIndex );
+                }
+                absoluteDotProducts[i] = std::abs( dot_product( 
+                        queryVectors + 3*queryPointIndex, vectors + 3*nearestPointIndex ) );
+            }
+            rawScore += scoreTable.sum( squaredDists.data(), absoluteDotProducts.data(), chunkSize );
+        }
+        return rawScore;
+    }
+
+    /*
+     * \brief the same with query_by, but search the nearest neighbor 
+     * of every query point in the tree one by one.
+     */
+    float query_by_single_tree(const VectorCloud &query, const ScoreTable &scoreTable, 
+                    const float &maxPointScore, const float &cutoff) const {
         // raw NBLAST is accumulated by query points
-        float rawScore=0, distance, absoluteDotProduct;
-        Index nearestPointIndex; 
-        xt::xtensor_fixed<float, xt::xshape<3>> queryPoint, nearestPoint, queryVector, targetVector;
-
-        const auto queryPoints = query.get_points();
-        const auto queryVectors = query.get_vectors();
-        for (Index queryPointIndex = 0; queryPointIndex<query.size(); queryPointIndex++){
-            
-            queryPoint = xt::view(queryPoints, queryPointIndex, xt::range(0, 3));
-            // find the best match point in target and get physical distance
-            nearestPointIndex = kdTree.knn( queryPoint, 1 )(0);
-            nearestPoint = xt::view(points, nearestPointIndex, xt::range(0,3));
-            distance = xt::norm_l2( nearestPoint - queryPoint )(0);
-           
-            // compute the absolute dot product between the principle vectors
-            queryVector = xt::view(queryVectors, queryPointIndex, xt::all());
-            targetVector = xt::view(vectors, nearestPointIndex, xt::all());
-            auto dotProduct = xt::linalg::dot(queryVector, targetVector)(0);
-            absoluteDotProduct = std::abs(dotProduct);
-            // absoluteDotProduct = std::abs(xt::linalg::dot( queryVector, targetVector )(0));
-            
+        float rawScore = 0;
+        const Index queryPointNum = query.size();
+        const float *queryPoints = query.get_points();
+        const float *queryVectors = query.get_vectors();
+        // the scores are looked up in chunks after the nearest neighbor search
+        std::array<float, SCORE_CHUNK_SIZE> squaredDists, absoluteDotProducts;
+        // the consecutive query points are close in space, so the nearest neighbor 
+        // of previous one is a good candidate to start with.
+        Index candidatePointIndex = std::numeric_limits<Index>::max();
+        for (Index chunkStart = 0; chunkStart<queryPointNum; chunkStart += SCORE_CHUNK_SIZE){
+            const float upperBound = rawScore + (queryPointNum - chunkStart) * maxPointScore;
+            if (upperBound < cutoff){
+                return upperBound;
+            }
+            const Index chunkSize = std::min(SCORE_CHUNK_SIZE, queryPointNum - chunkStart);
+            for (Index i=0; i<chunkSize; i++){
+                const Index queryPointIndex = chunkStart + i;
+                const float *queryPoint = queryPoints + 3*queryPointIndex;
+                // find the best match point in target and get squared physical distance
+                const auto [nearestPointIndex, squaredDist] = 
+                    candidatePointIndex < pointNum ? 
+                    kdTree.nearest_neighbor( queryPoint, candidatePointIndex, 
+                        squared_distance( queryPoint, points + 3*candidatePointIndex ) ) :
+                    kdTree.nearest_neighbor( queryPoint );
+                candidatePointIndex = nearestPointIndex;
+                squaredDists[i] = squaredDist;
+               
+                // compute the absolute dot product between the principle vectors
+                absoluteDotProducts[i] = std::abs( dot_product( 
+                        queryVectors + 3*queryPointIndex, vectors + 3*nearestPointIndex ) );
+            }
             // lookup the score table and accumulate the score
-            rawScore += scoreTable( distance,  absoluteDotProduct );
-            
-            // std::cout<< "\n "<< queryPointIndex << " th query point: " << queryPoint <<std::endl;
-            // std::cout<< "nearest point index: "<< nearestPointIndex << " : " << nearestPoint << std::endl;
-            // std::cout<< "vectors: "<<queryVector << "   "<< targetVector << std::endl;
-            // std::cout<< "distance: "<< distance << ";   absolute dot product: " 
-            //                                     << absoluteDotProduct << std::endl;
-            // std::cout<< "accumulate score: "<< scoreTable(distance, absoluteDotProduct) << " to " << rawScore<< std::endl; 
+            rawScore += scoreTable.sum( squaredDists.data(), absoluteDotProducts.data(), chunkSize );
         }
         return rawScore; 
     }
+
+    /*
+     * \param cutoff: give up once the score can not reach the cutoff any more. 
+     *      Every remaining query point could add at most the max score of table.
+     * \param approximateFarPairs: if the bounding boxes of two clouds are farther 
+     *      than the far distance of table, every query point falls in the last row 
+     *      of table, and the best case score of last row is returned without searching.
+     * \return the raw score, or an upper bound lower than cutoff if given up.
+     */
+    float query_by(const VectorCloud &query, const ScoreTable &scoreTable, 
+                    const float &cutoff = std::numeric_limits<float>::lowest(), 
+                    const bool &approximateFarPairs = false) const {
+        const float farDistance = scoreTable.far_distance();
+        const bool isFar = kdTree.get_bounding_box().min_squared_distance_from(
+                query.get_kd_tree().get_bounding_box() ) >= farDistance * farDistance;
+        const float maxPointScore = isFar ? scoreTable.max_far_score() : scoreTable.max_score();
+        if (isFar){
+            const float farScore = query.size() * maxPointScore;
+            if (approximateFarPairs || farScore < cutoff){
+                return farScore;
+            }
+        }
+
+        if (nearestPointGrid){
+            return query_by_grid( query, scoreTable, maxPointScore, cutoff );
+        }
+
+        if (query.size() >= DUAL_TREE_MIN_POINT_NUM && size() >= DUAL_TREE_MIN_POINT_NUM){
+            return query_by_dual_tree( query, scoreTable, cutoff );
+        }
+
+        return query_by_single_tree( query, scoreTable, maxPointScore, cutoff );
+    }
 }; // VectorCloud class
 
+/*
+ * a compact form of vector cloud to keep a large number of clouds in memory.
+ * The points are int16 offsets from the center of bounding box at a resolution, 
+ * and the vectors are octahedral encoded with two integers.
+ * The points and vectors are stored in the bucket order of kd tree, so the 
+ * tree only keeps its nodes and shares the point storage.
+ * The distances are exact up to the resolution, which should be much smaller 
+ * than the distance bins of score table.
+ * \tparam VectorComponent: std::int8_t or std::int16_t for 8 or 16 bits octahedral encoding
+ */
+template<class VectorComponent = std::int8_t>
+class CompactVectorCloud{
+
+private:
+    Index pointNum;
+    float resolution;
+    // the center of bounding box in physical coordinate
+    std::array<float, 3> origin;
+    // in physical coordinate
+    BoundingBox boundingBox;
+    // the root cell of tree in quantized coordinate, min corner followed by max corner
+    std::array<float, 6> quantizedBox;
+    std::vector<KDTreeNode> kdTreeNodes;
+    // structure of arrays in bucket order, all x, then all y, then all z
+    std::vector<std::int16_t> pointsBucket;
+    // two components for each point in bucket order
+    std::vector<VectorComponent> vectorsBucket;
+
+    /*
+     * the leaf decoder of quantized points for search_kd_tree_nodes.
+     * The point index is the bucket index, since the points are stored in bucket order.
+     */
+    struct QuantizedLeafPoints{
+        const std::int16_t *xs;
+        const std::int16_t *ys;
+        const std::int16_t *zs;
+
+        inline void squared_distances(const float *queryPoint, const Index &chunkStart, 
+                                    const Index &chunkSize, float *squaredDists) const {
+            // the leaf points are decoded to float to reuse the SIMD kernel
+            std::array<float, 3 * LEAF_CHUNK_SIZE> chunkPoints;
+            float *chunkXs = chunkPoints.data();
+            float *chunkYs = chunkXs + LEAF_CHUNK_SIZE;
+            float *chunkZs = chunkYs + LEAF_CHUNK_SIZE;
+            std::copy(xs + chunkStart, xs + chunkStart + chunkSize, chunkXs);
+            std::copy(ys + chunkStart, ys + chunkStart + chunkSize, chunkYs);
+            std::copy(zs + chunkStart, zs + chunkStart + chunkSize, chunkZs);
+            utils::squared_distances( chunkXs, chunkYs, chunkZs, chunkSize, 
+                                                        queryPoint, squaredDists );
+        }
+
+        inline Index get_point_index(const Index &bucketIndex) const {
+            return bucketIndex;
+        }
+    };
+
+    /*
+     * \param queryPoint: in quantized coordinate
+     * \param candidateBucketIndex: a known candidate to start with, such as the 
+     *      nearest neighbor of previous query point. Ignored if out of range.
+     * \return the bucket index and squared distance in quantized coordinate
+     */
+    std::pair<Index, float> nearest_neighbor(const float *queryPoint, 
+                const Index &candidateBucketIndex = std::numeric_limits<Index>::max()) const {
+        const QuantizedLeafPoints leafPoints = {pointsBucket.data(), 
+                    pointsBucket.data() + pointNum, pointsBucket.data() + 2*pointNum};
+        NearestNeighbor nearestNeighbor;
+        if (candidateBucketIndex < pointNum){
+            float squaredDist;
+            leafPoints.squared_distances( queryPoint, candidateBucketIndex, 1, &squaredDist );
+            nearestNeighbor.update( squaredDist, candidateBucketIndex );
+        }
+        SearchBudget budget;
+        search_kd_tree_nodes( kdTreeNodes.data(), BoundingBox( quantizedBox.data() ), 
+                                    leafPoints, queryPoint, nearestNeighbor, budget );
+        return std::make_pair( nearestNeighbor.get_point_index(), 
+                                nearestNeighbor.max_squared_dist() );
+    }
+
+public:
+    /*
+     * \param resolution_: the physical size of one quantization step. 
+     *      The bounding box should be smaller than 65535 steps.
+     * \param threadNum: the number of threads to build the tree, 0 means all the hardware threads.
+     */
+    CompactVectorCloud( const VectorCloud &vectorCloud, const float &resolution_, 
+                                                const std::size_t &threadNum = 0 ):
+            pointNum(vectorCloud.size()), resolution(resolution_), 
+            boundingBox(vectorCloud.get_kd_tree().get_bounding_box()){
+        if (resolution <= 0.f){
+            throw std::runtime_error("the resolution should be positive.");
+        }
+        const float *minCorner = boundingBox.data();
+        const float *maxCorner = minCorner + 3;
+        for (Index dim=0; dim<3; dim++){
+            origin[dim] = (minCorner[dim] + maxCorner[dim]) / 2.f;
+            if ((maxCorner[dim] - minCorner[dim]) / resolution >= 65535.f){
+                throw std::runtime_error("the bounding box is too large for the resolution.");
+            }
+        }
+
+        // build the tree in quantized coordinate, so the cut values are comparable 
+        // to the quantized points directly.
+        const float *points = vectorCloud.get_points();
+        Points::shape_type sh = {pointNum, 3};
+        Points quantizedPoints = xt::empty<float>(sh);
+        for (Index pointIdx=0; pointIdx<pointNum; pointIdx++){
+            for (Index dim=0; dim<3; dim++){
+                quantizedPoints(pointIdx, dim) = std::round( 
+                        (points[3*pointIdx + dim] - origin[dim]) / resolution );
+            }
+        }
+        const KDTree kdTree( quantizedPoints, vectorCloud.get_kd_tree().get_leaf_size(), 
+                                                                                threadNum );
+        kdTreeNodes = kdTree.get_kd_tree_nodes();
+        std::copy(kdTree.get_bounding_box().data(), kdTree.get_bounding_box().data() + 6, 
+                                                                    quantizedBox.begin());
+
+        const auto pointIndicesBucket = kdTree.get_point_indices_bucket();
+        const float *vectors = vectorCloud.get_vectors();
+        pointsBucket.resize( 3 * pointNum );
+        vectorsBucket.resize( 2 * pointNum );
+        for (Index bucketIdx=0; bucketIdx<pointNum; bucketIdx++){
+            const Index pointIdx = pointIndicesBucket[ bucketIdx ];
+            for (Index dim=0; dim<3; dim++){
+                pointsBucket[ dim*pointNum + bucketIdx ] = static_cast<std::int16_t>( 
+                                                        quantizedPoints(pointIdx, dim) );
+            }
+            utils::octahedral_encode( vectors + 3*pointIdx, &vectorsBucket[ 2*bucketIdx ] );
+        }
+    }
+
+    inline auto size() const {
+        return pointNum;
+    }
+
+    inline auto get_resolution() const {
+        return resolution;
+    }
+
+    inline const auto& get_bounding_box() const {
+        return boundingBox;
+    }
+
+    // the memory of points, vectors and tree nodes
+    inline std::size_t get_byte_num() const {
+        return pointsBucket.size() * sizeof(std::int16_t) + 
+                vectorsBucket.size() * sizeof(VectorComponent) + 
+                kdTreeNodes.size() * sizeof(KDTreeNode);
+    }
+
+    // the physical coordinate of a point in bucket order
+    inline void decode_point(const Index &bucketIdx, float *point) const {
+        for (Index dim=0; dim<3; dim++){
+            point[dim] = origin[dim] + resolution * pointsBucket[ dim*pointNum + bucketIdx ];
+        }
+    }
+
+    inline void decode_vector(const Index &bucketIdx, float *vector) const {
+        utils::octahedral_decode( &vectorsBucket[ 2*bucketIdx ], vector );
+    }
+
+    // the decoded points in bucket order
+    inline auto get_py_points() const {
+        PyPoints::shape_type sh = {pointNum, 3};
+        PyPoints pyPoints = xt::empty<float>(sh);
+        for (Index bucketIdx=0; bucketIdx<pointNum; bucketIdx++){
+            decode_point( bucketIdx, pyPoints.data() + 3*bucketIdx );
+        }
+        return pyPoints;
+    }
+
+    // the decoded vectors in bucket order
+    inline auto get_py_vectors() const {
+        PyPoints::shape_type sh = {pointNum, 3};
+        PyPoints pyVectors = xt::empty<float>(sh);
+        for (Index bucketIdx=0; bucketIdx<pointNum; bucketIdx++){
+            decode_vector( bucketIdx, pyVectors.data() + 3*bucketIdx );
+        }
+        return pyVectors;
+    }
+
+    float query_by_self(const ScoreTable &scoreTable) const {
+        return size() * scoreTable.self_score();
+    }
+
+    /*
+     * \brief the same with VectorCloud::query_by, but works on the compact form directly.
+     */
+    float query_by(const CompactVectorCloud &query, const ScoreTable &scoreTable, 
+                    const float &cutoff = std::numeric_limits<float>::lowest(), 
+                    const bool &approximateFarPairs = false) const {
+        const float farDistance = scoreTable.far_distance();
+        const bool isFar = boundingBox.min_squared_distance_from( 
+                        query.get_bounding_box() ) >= farDistance * farDistance;
+        const float maxPointScore = isFar ? scoreTable.max_far_score() : scoreTable.max_score();
+        if (isFar){
+            const float farScore = query.size() * maxPointScore;
+            if (approximateFarPairs || farScore < cutoff){
+                return farScore;
+            }
+        }
+
+        const float squaredResolution = resolution * resolution;
+        float rawScore = 0;
+        const Index queryPointNum = query.size();
+        std::array<float, SCORE_CHUNK_SIZE> squaredDists, absoluteDotProducts;
+        // the query points in bucket order are close in space, start from the previous match
+        Index candidateBucketIndex = std::numeric_limits<Index>::max();
+        for (Index chunkStart = 0; chunkStart<queryPointNum; chunkStart += SCORE_CHUNK_SIZE){
+            const float upperBound = rawScore + (queryPointNum - chunkStart) * maxPointScore;
+            if (upperBound < cutoff){
+                return upperBound;
+            }
+            const Index chunkSize = std::min(SCORE_CHUNK_SIZE, queryPointNum - chunkStart);
+            for (Index i=0; i<chunkSize; i++){
+                const Index queryBucketIndex = chunkStart + i;
+                // transform the query point to the quantized coordinate of this cloud
+                float queryPoint[3];
+                query.decode_point( queryBucketIndex, queryPoint );
+                for (Index dim=0; dim<3; dim++){
+                    queryPoint[dim] = (queryPoint[dim] - origin[dim]) / resolution;
+                }
+                const auto [nearestBucketIndex, squaredDist] = nearest_neighbor( 
+                                                        queryPoint, candidateBucketIndex );
+                candidateBucketIndex = nearestBucketIndex;
+                squaredDists[i] = squaredDist * squaredResolution;
+
+                float queryVector[3], targetVector[3];
+                query.decode_vector( queryBucketIndex, queryVector );
+                decode_vector( nearestBucketIndex, targetVector );
+                absoluteDotProducts[i] = std::abs( 
+                                VectorCloud::dot_product( queryVector, targetVector ) );
+            }
+            rawScore += scoreTable.sum( squaredDists.data(), absoluteDotProducts.data(), chunkSize );
+        }
+        return rawScore;
+    }
+}; // CompactVectorCloud class
+
+/*
+ * the binary format of a library of vector clouds:
+ * header, the table of entries, then the sections of every cloud. 
+ * all the sections are aligned to utils::BINARY_ALIGNMENT, 
+ * so the file could be memory mapped and used in place.
+ */
+struct VectorCloudLibraryHeader{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t cloudNum;
+    // the offset of entry table from the start of file
+    std::uint64_t entriesOffset;
+    // the total size including the padding
+    std::uint64_t size;
+};
+
+struct VectorCloudEntry{
+    // the offsets of sections from the start of file
+    std::uint64_t pointsOffset;
+    std::uint64_t vectorsOffset;
+    std::uint64_t kdTreeOffset;
+    // the input index of each point, 0 if the points are not reordered
+    std::uint64_t pointIndicesOffset;
+    std::uint32_t pointNum;
+    // the raw score of querying the cloud by itself
+    float selfScore;
+    // the min corner followed by the max corner
+    float boundingBox[6];
+};
+
+const char VECTOR_CLOUD_LIBRARY_MAGIC[8] = {'R', 'E', 'N', 'E', 'U', 'V', 'C', 'L'};
+const std::uint32_t VECTOR_CLOUD_LIBRARY_FORMAT_VERSION = 2;
+
+/*
+ * \brief pack the vector clouds into a library file.
+ * \param scoreTable: used to compute the self scores
+ */
+inline void save_vector_clouds( const std::string &fileName, 
+                                const std::vector<VectorCloud> &vectorClouds, 
+                                const ScoreTable &scoreTable ){
+    const Index cloudNum = vectorClouds.size();
+    VectorCloudLibraryHeader header;
+    std::memset(&header, 0, sizeof(VectorCloudLibraryHeader));
+    std::memcpy(header.magic, VECTOR_CLOUD_LIBRARY_MAGIC, sizeof(VECTOR_CLOUD_LIBRARY_MAGIC));
+    header.version = VECTOR_CLOUD_LIBRARY_FORMAT_VERSION;
+    header.cloudNum = cloudNum;
+    header.entriesOffset = utils::align_offset( sizeof(VectorCloudLibraryHeader) );
+
+    std::vector<VectorCloudEntry> entries( cloudNum );
+    std::size_t offset = utils::align_offset( 
+                            header.entriesOffset + cloudNum * sizeof(VectorCloudEntry) );
+    for (Index cloudIdx = 0; cloudIdx < cloudNum; cloudIdx++){
+        const VectorCloud &vectorCloud = vectorClouds[ cloudIdx ];
+        const KDTree &kdTree = vectorCloud.get_kd_tree();
+        VectorCloudEntry &entry = entries[ cloudIdx ];
+        std::memset(&entry, 0, sizeof(VectorCloudEntry));
+        entry.pointNum = vectorCloud.size();
+        entry.selfScore = vectorCloud.query_by_self( scoreTable );
+        const float *boundingBox = kdTree.get_bounding_box().data();
+        std::copy(boundingBox, boundingBox + 6, entry.boundingBox);
+        entry.pointsOffset = offset;
+        entry.vectorsOffset = utils::align_offset( 
+                                entry.pointsOffset + 3 * entry.pointNum * sizeof(float) );
+        entry.kdTreeOffset = utils::align_offset( 
+                                entry.vectorsOffset + 3 * entry.pointNum * sizeof(float) );
+        offset = entry.kdTreeOffset + kdTree.get_binary_header().size;
+        if (vectorCloud.get_point_indices()){
+            entry.pointIndicesOffset = utils::align_offset( offset );
+            offset = entry.pointIndicesOffset + entry.pointNum * sizeof(Index);
+        }
+    }
+    header.size = offset;
+
+    std::ofstream out(fileName, std::ios::out | std::ios::binary);
+    if (!out.is_open()){
+        throw std::runtime_error("can not open file: " + fileName);
+    }
+    std::size_t position = 0;
+    const std::vector<char> padding(utils::BINARY_ALIGNMENT, 0);
+    auto write_section = [&](const void *data, const std::size_t &start, 
+                                                const std::size_t &bytes){
+        out.write(padding.data(), start - position);
+        out.write(static_cast<const char*>(data), bytes);
+        position = start + bytes;
+    };
+    write_section(&header, 0, sizeof(VectorCloudLibraryHeader));
+    write_section(entries.data(), header.entriesOffset, 
+                                    cloudNum * sizeof(VectorCloudEntry));
+    for (Index cloudIdx = 0; cloudIdx < cloudNum; cloudIdx++){
+        const VectorCloud &vectorCloud = vectorClouds[ cloudIdx ];
+        const VectorCloudEntry &entry = entries[ cloudIdx ];
+        write_section(vectorCloud.get_points(), entry.pointsOffset, 
+                                    3 * entry.pointNum * sizeof(float));
+        write_section(vectorCloud.get_vectors(), entry.vectorsOffset, 
+                                    3 * entry.pointNum * sizeof(float));
+        out.write(padding.data(), entry.kdTreeOffset - position);
+        position = entry.kdTreeOffset + vectorCloud.get_kd_tree().write(out);
+        if (entry.pointIndicesOffset){
+            write_section(vectorCloud.get_point_indices(), entry.pointIndicesOffset, 
+                                    entry.pointNum * sizeof(Index));
+        }
+    }
+    if (!out){
+        throw std::runtime_error("failed to write file: " + fileName);
+    }
+}
+
+/*
+ * \brief a memory mapped library of vector clouds saved by save_vector_clouds. 
+ * The vector clouds are views of the file, so loading is almost free, 
+ * and the pages are only read from disk when they are used.
+ */
+class VectorCloudLibrary{
+private:
+    std::shared_ptr<const utils::MappedFile> file;
+    const VectorCloudLibraryHeader *header;
+    const VectorCloudEntry *entries;
+
+public:
+    VectorCloudLibrary( const std::string &fileName ): 
+            file(std::shared_ptr<const utils::MappedFile>(
+                    std::make_shared<utils::MappedFile>(fileName))){
+        const std::size_t fileSize = file->get_size();
+        if (fileSize < sizeof(VectorCloudLibraryHeader)){
+            throw std::runtime_error("the file is too small to be a vector cloud library.");
+        }
+        header = reinterpret_cast<const VectorCloudLibraryHeader*>(file->data());
+        if (std::memcmp(header->magic, VECTOR_CLOUD_LIBRARY_MAGIC, 
+                                        sizeof(VECTOR_CLOUD_LIBRARY_MAGIC)) != 0){
+            throw std::runtime_error("the file is not a vector cloud library: " + fileName);
+        }
+        if (header->version != VECTOR_CLOUD_LIBRARY_FORMAT_VERSION){
+            throw std::runtime_error("unsupported vector cloud library format version: " + 
+                                        std::to_string(header->version));
+        }
+        if (header->size > fileSize || !utils::is_valid_section<VectorCloudEntry>(
+                                header->entriesOffset, header->cloudNum, header->size)){
+            throw std::runtime_error("the vector cloud library is truncated: " + fileName);
+        }
+        entries = reinterpret_cast<const VectorCloudEntry*>(
+                                                file->data() + header->entriesOffset);
+    }
+
+    inline auto size() const {
+        return header->cloudNum;
+    }
+
+    inline const auto& get_entry(const Index &cloudIdx) const {
+        if (cloudIdx >= size()){
+            throw std::out_of_range("vector cloud index out of range: " + 
+                                                        std::to_string(cloudIdx));
+        }
+        return entries[ cloudIdx ];
+    }
+
+    auto get_vector_cloud(const Index &cloudIdx) const {
+        const auto &entry = get_entry( cloudIdx );
+        const std::uint64_t coordinateNum = 3 * std::uint64_t(entry.pointNum);
+        if (!utils::is_valid_section<float>(entry.pointsOffset, coordinateNum, header->size) ||
+                !utils::is_valid_section<float>(entry.vectorsOffset, coordinateNum, 
+                                                                        header->size) ||
+                !utils::is_valid_section<Index>(entry.pointIndicesOffset, entry.pointNum, 
+                                                                        header->size) ||
+                entry.kdTreeOffset > header->size){
+            throw std::runtime_error("the vector cloud library is corrupted.");
+        }
+        const Index *pointIndices = entry.pointIndicesOffset == 0 ? nullptr : 
+                reinterpret_cast<const Index*>(file->data() + entry.pointIndicesOffset);
+        // the tree checks its own sections
+        KDTree kdTree( file->data() + entry.kdTreeOffset, 
+                        header->size - entry.kdTreeOffset, file );
+        if (kdTree.get_point_num() != entry.pointNum){
+            throw std::runtime_error("the vector cloud library is corrupted.");
+        }
+        return VectorCloud( entry.pointNum, 
+                    reinterpret_cast<const float*>(file->data() + entry.pointsOffset),
+                    reinterpret_cast<const float*>(file->data() + entry.vectorsOffset), 
+                    kdTree, file, pointIndices );
+    }
+
+    /*
+     * \brief the views of clouds in range of [start, stop)
+     */
+    auto get_vector_clouds( const Index &start = 0, 
+                            const Index &stop = std::numeric_limits<Index>::max() ) const {
+        const Index stop_ = std::min(stop, static_cast<Index>(size()));
+        std::vector<VectorCloud> vectorClouds;
+        vectorClouds.reserve( stop_ > start ? stop_ - start : 0 );
+        for (Index cloudIdx = start; cloudIdx < stop_; cloudIdx++){
+            vectorClouds.push_back( get_vector_cloud( cloudIdx ) );
+        }
+        return vectorClouds;
+    }
+
+    auto get_self_scores() const {
+        xt::xtensor<float, 1>::shape_type sh = {size()};
+        xt::xtensor<float, 1> selfScores = xt::empty<float>(sh);
+        for (Index cloudIdx = 0; cloudIdx < size(); cloudIdx++){
+            selfScores( cloudIdx ) = entries[ cloudIdx ].selfScore;
+        }
+        return selfScores;
+    }
+
+    // the min corner followed by the max corner of every cloud
+    auto get_bounding_boxes() const {
+        xt::xtensor<float, 2>::shape_type sh = {size(), 6};
+        xt::xtensor<float, 2> boundingBoxes = xt::empty<float>(sh);
+        for (Index cloudIdx = 0; cloudIdx < size(); cloudIdx++){
+            std::copy( entries[ cloudIdx ].boundingBox, entries[ cloudIdx ].boundingBox + 6, 
+                            boundingBoxes.data() + 6 * cloudIdx );
+        }
+        return boundingBoxes;
+    }
+}; // VectorCloudLibrary class
+
+// the number of targets and queries in a block of score matrix. 
+// A thread scores a block, so the trees and vectors of a few targets and queries 
+// stay in cache while they are compared against each other. 
+const Index SCORE_MATRIX_TILE_SIZE = 8;
+
 class NBLASTScoreMatrix{
 private:
 // the rows are targets, the columns are queries
 xt::xtensor<float, 2> rawScoreMatrix;
+// normalized by the self score of query
+xt::xtensor<float, 2> normalizedScoreMatrix;
+// the mean of normalized scores of both directions
+xt::xtensor<float, 2> meanScoreMatrix;
+
+    inline auto score_pair( const std::vector<VectorCloud> &vectorClouds, 
+                            const ScoreTable &scoreTable, 
+                            const Index &targetIdx, const Index &queryIdx ) const {
+        const VectorCloud &target = vectorClouds[ targetIdx ];
+        if (targetIdx == queryIdx){
+            return target.query_by_self( scoreTable );
+        } else {
+            return target.query_by( vectorClouds[ queryIdx ], scoreTable );
+        }
+    }
+
+    inline void update_normalized_score( const Index &targetIdx, const Index &queryIdx ){
+        normalizedScoreMatrix( targetIdx, queryIdx ) = 
+            rawScoreMatrix( targetIdx, queryIdx ) / rawScoreMatrix( queryIdx, queryIdx );
+    }
+
+    inline void update_mean_score( const Index &targetIdx, const Index &queryIdx ){
+        if (targetIdx == queryIdx){
+            meanScoreMatrix( targetIdx, queryIdx ) = 1;
+            return;
+        }
+        meanScoreMatrix( targetIdx, queryIdx ) = (normalizedScoreMatrix( targetIdx, queryIdx ) + 
+                                                  normalizedScoreMatrix( queryIdx, targetIdx )) / 2;
+        meanScoreMatrix( queryIdx, targetIdx ) = meanScoreMatrix( targetIdx, queryIdx );
+    }
+
+    void compute_derived_score_matrices(){
+        const Index neuronNum = rawScoreMatrix.shape(0);
+        normalizedScoreMatrix = xt::zeros_like( rawScoreMatrix );
+        meanScoreMatrix = xt::ones_like( rawScoreMatrix );
+        for (Index queryIdx = 0; queryIdx<neuronNum; queryIdx++){
+            for (Index targetIdx = 0; targetIdx<neuronNum; targetIdx++){
+                update_normalized_score( targetIdx, queryIdx );
+            }
+        }
+        for (Index targetIdx = 0; targetIdx<neuronNum; targetIdx++){
+            for (Index queryIdx = targetIdx+1; queryIdx<neuronNum; queryIdx++){
+                update_mean_score( targetIdx, queryIdx );
+            }
+        }
+    }
 
 public:
+    /*
+     * \param threadNum: the number of threads, 0 means all the hardware threads.
+     */
     NBLASTScoreMatrix(  const std::vector<VectorCloud> &vectorClouds, 
-                        const ScoreTable &scoreTable){
-        Index vcNum = vectorClouds.size();
+                        const ScoreTable &scoreTable, const Index &threadNum = 0){
+        const Index vcNum = vectorClouds.size();
         xt::xtensor<float, 2>::shape_type shape = {vcNum, vcNum};
         rawScoreMatrix = xt::empty<float>( shape );
 
-        for (Index targetIdx = 0; targetIdx<vcNum; targetIdx++){
-            VectorCloud target = vectorClouds[ targetIdx ];
-            for (Index queryIdx = 0; queryIdx<vcNum; queryIdx++){
-                if (targetIdx == queryIdx){
-                    rawScoreMatrix(targetIdx, queryIdx) = target.query_by_self(scoreTable);
-                } else {
-                    auto query = vectorClouds[ queryIdx ];
-                    rawScoreMatrix( targetIdx, queryIdx ) = target.query_by( query, scoreTable );
+        const Index tileNum = (vcNum + SCORE_MATRIX_TILE_SIZE - 1) / SCORE_MATRIX_TILE_SIZE;
+        utils::parallel_for( tileNum * tileNum, [&](const std::size_t &tileIdx){
+            const Index targetStart = tileIdx / tileNum * SCORE_MATRIX_TILE_SIZE;
+            const Index queryStart = tileIdx % tileNum * SCORE_MATRIX_TILE_SIZE;
+            const Index targetStop = std::min(targetStart + SCORE_MATRIX_TILE_SIZE, vcNum);
+            const Index queryStop = std::min(queryStart + SCORE_MATRIX_TILE_SIZE, vcNum);
+            for (Index targetIdx = targetStart; targetIdx<targetStop; targetIdx++){
+                for (Index queryIdx = queryStart; queryIdx<queryStop; queryIdx++){
+                    rawScoreMatrix( targetIdx, queryIdx ) = 
+                            score_pair( vectorClouds, scoreTable, targetIdx, queryIdx );
                 }
             }
+        }, threadNum);
+        compute_derived_score_matrices();
+    }
+
+    /*
+     * \brief wrap a raw score matrix computed elsewhere, such as merged blocks.
+     */
+    NBLASTScoreMatrix( const xt::pytensor<float, 2> &rawScoreMatrix_ ): 
+                                                    rawScoreMatrix(rawScoreMatrix_){
+        if (rawScoreMatrix.shape(0) != rawScoreMatrix.shape(1)){
+            throw std::runtime_error("the raw score matrix should be square.");
         }
+        compute_derived_score_matrices();
     }
 
     //NBLASTScoreMatrix( const py::list &vectorClouds, const ScoreTable scoreTable ){
@@ -282,6 +1233,82 @@ public:
     //    
     //}
 
+    /*
+     * \brief rescore the new or replaced vector clouds in place. 
+     * Only the rows and columns of changed clouds are computed. 
+     * \param vectorClouds: all the clouds after the change. The new clouds are appended 
+     *      after the existing ones, and they are always rescored.
+     * \param changedIndices: the indices of replaced clouds.
+     * \param threadNum: the number of threads, 0 means all the hardware threads.
+     */
+    void update( const std::vector<VectorCloud> &vectorClouds, 
+                 const std::vector<Index> &changedIndices, 
+                 const ScoreTable &scoreTable, const Index &threadNum = 0 ){
+        const Index oldNum = rawScoreMatrix.shape(0);
+        const Index vcNum = vectorClouds.size();
+        if (vcNum < oldNum){
+            throw std::runtime_error("the vector clouds could only be replaced or appended.");
+        }
+
+        std::vector<bool> isChanged( vcNum, false );
+        for (const auto &changedIdx : changedIndices){
+            if (changedIdx >= vcNum){
+                throw std::out_of_range("changed index out of range: " + 
+                                                        std::to_string(changedIdx));
+            }
+            isChanged[ changedIdx ] = true;
+        }
+        std::fill( isChanged.begin() + oldNum, isChanged.end(), true );
+        std::vector<Index> changed;
+        for (Index idx = 0; idx<vcNum; idx++){
+            if (isChanged[ idx ]){
+                changed.push_back( idx );
+            }
+        }
+
+        if (vcNum > oldNum){
+            // keep the scores of existing clouds
+            xt::xtensor<float, 2>::shape_type shape = {vcNum, vcNum};
+            auto grow = [&](xt::xtensor<float, 2> &matrix){
+                xt::xtensor<float, 2> grown = xt::empty<float>( shape );
+                for (Index targetIdx = 0; targetIdx<oldNum; targetIdx++){
+                    std::copy( matrix.data() + targetIdx * oldNum, 
+                               matrix.data() + (targetIdx + 1) * oldNum, 
+                               grown.data() + targetIdx * vcNum );
+                }
+                matrix = std::move( grown );
+            };
+            grow( rawScoreMatrix );
+            grow( normalizedScoreMatrix );
+            grow( meanScoreMatrix );
+        }
+
+        // the row and column of every changed cloud. 
+        // the pair of two changed clouds is only scored in the row of target.
+        utils::parallel_for( changed.size() * vcNum, [&](const std::size_t &taskIdx){
+            const Index changedIdx = changed[ taskIdx / vcNum ];
+            const Index otherIdx = taskIdx % vcNum;
+            rawScoreMatrix( changedIdx, otherIdx ) = 
+                        score_pair( vectorClouds, scoreTable, changedIdx, otherIdx );
+            if (!isChanged[ otherIdx ]){
+                rawScoreMatrix( otherIdx, changedIdx ) = 
+                        score_pair( vectorClouds, scoreTable, otherIdx, changedIdx );
+            }
+        }, threadNum);
+
+        for (const auto &changedIdx : changed){
+            for (Index otherIdx = 0; otherIdx<vcNum; otherIdx++){
+                update_normalized_score( changedIdx, otherIdx );
+                update_normalized_score( otherIdx, changedIdx );
+            }
+        }
+        for (const auto &changedIdx : changed){
+            for (Index otherIdx = 0; otherIdx<vcNum; otherIdx++){
+                update_mean_score( changedIdx, otherIdx );
+            }
+        }
+    }
+
     inline auto get_neuron_number() const {
         return rawScoreMatrix.shape(0);
     }
@@ -294,28 +1321,162 @@ public:
      * \brief normalized by the self score of query
      */
     inline auto get_normalized_score_matrix() const {
-        xt::xtensor<float, 2> normalizedScoreMatrix = xt::zeros_like(rawScoreMatrix);
-        for (Index queryIdx = 0; queryIdx<get_neuron_number(); queryIdx++){
-            auto selfQueryScore = rawScoreMatrix( queryIdx, queryIdx );
-            for (Index targetIdx = 0; targetIdx<get_neuron_number(); targetIdx++){
-                normalizedScoreMatrix(targetIdx, queryIdx) = rawScoreMatrix(targetIdx, queryIdx) / selfQueryScore;
-            }
-        }
         return normalizedScoreMatrix; 
     }
 
     inline auto get_mean_score_matrix() const {
-        auto normalizedScoreMatrix = get_normalized_score_matrix();
-        auto meanScoreMatrix = xt::ones_like( normalizedScoreMatrix );
-        for (Index targetIdx = 0; targetIdx<get_neuron_number(); targetIdx++){
-            for (Index queryIdx = targetIdx+1; queryIdx<get_neuron_number(); queryIdx++){
-                meanScoreMatrix(targetIdx, queryIdx) = (normalizedScoreMatrix(targetIdx, queryIdx) + 
-                                                        normalizedScoreMatrix(queryIdx, targetIdx)) / 2;
-                meanScoreMatrix(queryIdx, targetIdx) = meanScoreMatrix(targetIdx, queryIdx);
-            }
-        }
         return meanScoreMatrix;
     }
 };
 
+/*
+ * \brief score a batch of queries against a library of targets.
+ * The rows of scores are queries and the columns are targets, 
+ * and the blocks of scores are written in place as soon as they are finished. 
+ * \param scores: the output of queryNum x targetNum raw scores in C order. 
+ *      It could be a numpy array or a memory mapped file.
+ * \param threadNum: the number of threads, 0 means all the hardware threads.
+ */
+inline void query_targets( const std::vector<VectorCloud> &queries, 
+                    const std::vector<VectorCloud> &targets, 
+                    const ScoreTable &scoreTable, float *scores, 
+                    const Index &threadNum = 0, const bool &approximateFarPairs = false ){
+    const Index queryNum = queries.size();
+    const Index targetNum = targets.size();
+    const Index queryTileNum = (queryNum + SCORE_MATRIX_TILE_SIZE - 1) / SCORE_MATRIX_TILE_SIZE;
+    const Index targetTileNum = (targetNum + SCORE_MATRIX_TILE_SIZE - 1) / SCORE_MATRIX_TILE_SIZE;
+
+    // the tiles are handed out row by row, so the rows of queries are finished in order.
+    utils::parallel_for( queryTileNum * targetTileNum, [&](const std::size_t &tileIdx){
+        const Index queryStart = tileIdx / targetTileNum * SCORE_MATRIX_TILE_SIZE;
+        const Index targetStart = tileIdx % targetTileNum * SCORE_MATRIX_TILE_SIZE;
+        const Index queryStop = std::min(queryStart + SCORE_MATRIX_TILE_SIZE, queryNum);
+        const Index targetStop = std::min(targetStart + SCORE_MATRIX_TILE_SIZE, targetNum);
+        for (Index queryIdx = queryStart; queryIdx<queryStop; queryIdx++){
+            const VectorCloud &query = queries[ queryIdx ];
+            for (Index targetIdx = targetStart; targetIdx<targetStop; targetIdx++){
+                scores[ queryIdx * targetNum + targetIdx ] = targets[ targetIdx ].query_by( 
+                        query, scoreTable, std::numeric_limits<float>::lowest(), 
+                        approximateFarPairs );
+            }
+        }
+    }, threadNum);
+}
+
+/*
+ * \param scores: a preallocated writeable float32 numpy array in C order 
+ *      with shape of queryNum x targetNum.
+ */
+inline void py_query_targets(  const std::vector<VectorCloud> &queries, 
+                        const std::vector<VectorCloud> &targets, 
+                        const ScoreTable &scoreTable, xt::pytensor<float, 2> &scores, 
+                        const Index &threadNum = 0, const bool &approximateFarPairs = false ){
+    if (scores.shape(0) != queries.size() || scores.shape(1) != targets.size()){
+        throw std::runtime_error("the shape of scores should be query number x target number.");
+    }
+    // the scores are written through the raw pointer with C order offsets.
+    // the strides of axes with only one element could be anything.
+    const auto &strides = scores.strides();
+    if ((scores.shape(1) > 1 && strides[1] != 1) || 
+            (scores.shape(0) > 1 && strides[0] != static_cast<std::ptrdiff_t>(scores.shape(1)))){
+        throw std::runtime_error("the scores should be a contiguous array in C order.");
+    }
+    if (!PyArray_ISWRITEABLE( reinterpret_cast<PyArrayObject*>(scores.ptr()) )){
+        throw std::runtime_error("the scores should be writeable.");
+    }
+    query_targets( queries, targets, scoreTable, scores.data(), 
+                    threadNum, approximateFarPairs );
+}
+
+/*
+ * \brief the same with query_targets, but the scores are written to 
+ * a memory mapped .npy file, which could be larger than memory.
+ * The file could be loaded by `numpy.load(fileName, mmap_mode='r')`.
+ */
+inline void query_targets_to_file( const std::vector<VectorCloud> &queries, 
+                            const std::vector<VectorCloud> &targets, 
+                            const ScoreTable &scoreTable, const std::string &fileName, 
+                            const Index &threadNum = 0, 
+                            const bool &approximateFarPairs = false ){
+    const std::string header = utils::make_npy_header( queries.size(), targets.size() );
+    utils::MappedFile file( fileName, 
+                header.size() + sizeof(float) * queries.size() * targets.size() );
+    char *data = file.mutable_data();
+    std::copy( header.begin(), header.end(), data );
+    query_targets( queries, targets, scoreTable, 
+                    reinterpret_cast<float*>(data + header.size()), 
+                    threadNum, approximateFarPairs );
+    file.flush();
+}
+
+/*
+ * \brief find the best matching targets of every query. 
+ * Only the matches are returned, so the output is much smaller than a dense matrix. 
+ * The targets close to the query are scored first to raise the score cutoff quickly, 
+ * and a target is given up once it can not beat the current k-th best score.
+ * \param topK: the maximum number of matches per query, 0 means no limit.
+ * \param threshold: the minimum raw score of matches.
+ * \param threadNum: the number of threads, 0 means all the hardware threads.
+ * \return the query indices, target indices and raw scores of matches, 
+ *      grouped by query and sorted by descending score.
+ */
+inline auto search_targets( const std::vector<VectorCloud> &queries, 
+                    const std::vector<VectorCloud> &targets, 
+                    const ScoreTable &scoreTable, const Index &topK, 
+                    const float &threshold = std::numeric_limits<float>::lowest(), 
+                    const Index &threadNum = 0 ){
+    const Index queryNum = queries.size();
+    const Index targetNum = targets.size();
+    using Match = std::pair<float, Index>;
+    std::vector<std::vector<Match>> matchesList( queryNum );
+
+    utils::parallel_for( queryNum, [&](const std::size_t &queryIdx){
+        const VectorCloud &query = queries[ queryIdx ];
+        const auto &queryBox = query.get_kd_tree().get_bounding_box();
+        std::vector<Match> order( targetNum );
+        for (Index targetIdx = 0; targetIdx<targetNum; targetIdx++){
+            order[ targetIdx ] = { queryBox.min_squared_distance_from( 
+                        targets[ targetIdx ].get_kd_tree().get_bounding_box() ), targetIdx };
+        }
+        std::sort( order.begin(), order.end() );
+
+        // a min heap of the best matches found so far
+        std::vector<Match> &matches = matchesList[ queryIdx ];
+        for (const auto &[boxSquaredDist, targetIdx] : order){
+            const bool isFull = topK > 0 && matches.size() == topK;
+            const float cutoff = isFull ? std::max(threshold, matches.front().first) : threshold;
+            const float score = targets[ targetIdx ].query_by( query, scoreTable, cutoff );
+            if (score < threshold || (isFull && score <= matches.front().first)){
+                continue;
+            }
+            if (isFull){
+                std::pop_heap( matches.begin(), matches.end(), std::greater<Match>() );
+                matches.pop_back();
+            }
+            matches.emplace_back( score, targetIdx );
+            std::push_heap( matches.begin(), matches.end(), std::greater<Match>() );
+        }
+        std::sort_heap( matches.begin(), matches.end(), std::greater<Match>() );
+    }, threadNum);
+
+    Index matchNum = 0;
+    for (const auto &matches : matchesList){
+        matchNum += matches.size();
+    }
+    PointIndices::shape_type shape = {matchNum};
+    PointIndices queryIndices = xt::empty<Index>( shape );
+    PointIndices targetIndices = xt::empty<Index>( shape );
+    xt::xtensor<float, 1> scores = xt::empty<float>( shape );
+    Index matchIdx = 0;
+    for (Index queryIdx = 0; queryIdx<queryNum; queryIdx++){
+        for (const auto &[score, targetIdx] : matchesList[ queryIdx ]){
+            queryIndices( matchIdx ) = queryIdx;
+            targetIndices( matchIdx ) = targetIdx;
+            scores( matchIdx ) = score;
+            matchIdx++;
+        }
+    }
+    return std::make_tuple( queryIndices, targetIndices, scores );
+}
+
 } // end of namespace reneu::neuron::nblast
@@ -9,12 +9,19 @@
 #include <ctime>
 #include <chrono>
 #include <iomanip>
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <vector>
 
 #include "xtensor/xview.hpp"
 #include "xtensor/xsort.hpp"
 #include "xtensor/xadapt.hpp"
 
 #include "reneu/utils/string.hpp"
+#include "reneu/utils/swc.hpp"
+#include "reneu/utils/parallel.hpp"
 #include "reneu/type_aliase.hpp"
 
 
@@ -161,67 +168,18 @@ public:
         update_first_child_and_sibling();
     }
 
+    /**
+     * \brief read a SWC file. The points are sorted by point id.
+     */
     Skeleton( const std::string &file_name ){
-        std::cerr<< "this function is pretty slow and should be speed up using memory map!" << std::endl;
-        std::ifstream myfile(file_name, std::ios::in);
-
-        if (myfile.is_open()){
-            std::string line;
-            std::regex ws_re("\\s+"); // whitespace
-            
-            // initialize the data vectors
-            std::vector<int> ids = {};
-            std::vector<int> classes = {};
-            std::vector<float> xs = {};
-            std::vector<float> ys = {};
-            std::vector<float> zs = {};
-            std::vector<float> rs = {};
-            std::vector<int> parents = {};
-
-            while ( std::getline(myfile, line) ){
-                std::vector<std::string> parts = reneu::utils::split(line, "\\s+"_re);
-                if (parts.size()==7 && parts[0][0] != '#'){
-                    ids.push_back( std::stoi( parts[0] ) );
-                    classes.push_back( std::stoi( parts[1] ) );
-                    xs.push_back( std::stof( parts[2] ) );
-                    ys.push_back( std::stof( parts[3] ) );
-                    zs.push_back( std::stof( parts[4] ) );
-                    rs.push_back( std::stof( parts[5] ) );
-                    // swc is 1-based, and we are 0-based here.
-                    parents.push_back( std::stoi( parts[6] ) - 1);
-                }                
-            }
-            assert(ids.size() == parents.size());
-            myfile.close();
-            
-            // the point index could be unordered
-            // we should order them and will drop the ids column
-            auto pointNum = ids.size();
-            std::vector<std::size_t> shape = { pointNum, };
-            auto xids = xt::adapt(ids, shape);
-            auto newIdx2oldIdx = xt::argsort(xids);
-
-            // construct the points and attributes
-            initialize_points_and_attributes(pointNum);
-            
-            for (std::size_t i = 0; i<pointNum; i++){
-                // we do sort here!
-                auto oldIdx = newIdx2oldIdx( i );
-                points(i, 0) = xs[ oldIdx ];
-                points(i, 1) = ys[ oldIdx ];
-                points(i, 2) = zs[ oldIdx ];
-                points(i, 3) = rs[ oldIdx ];
-                attributes(i, 0) = classes[ oldIdx ];
-                // swc point id is 1-based
-                attributes(i, 1) = parents[ oldIdx ];
-            }
-            update_first_child_and_sibling();
-
-            auto childs = get_childs();
-            assert( xt::any( childs >= 0 ) );
-        }else{
-            std::cout << "can not open file: " << file_name << std::endl;
+        const auto records = reneu::utils::read_swc( file_name );
+        initialize_points_and_attributes( records.size() );
+        std::copy( records.points.begin(), records.points.end(), points.begin() );
+        for (std::size_t i = 0; i<records.size(); i++){
+            attributes(i, 0) = records.classes[ i ];
+            attributes(i, 1) = records.parents[ i ];
         }
+        update_first_child_and_sibling();
     }
     
     inline auto get_points() {
@@ -466,59 +424,119 @@ public:
         return pathLength;
     }
     
+    /**
+     * \brief format the skeleton as SWC text. 
+     * The numbers are formatted with std::to_chars into a buffer sized for the 
+     * longest lines, so there is no stream or reallocation.
+     */
     std::string to_swc_str( const int precision = 3 ) const {
-        std::ostringstream swc;
-        swc << std::fixed;
-        swc << std::setprecision( precision );
-        auto classes = get_classes();
-        auto parents = get_parents();
-        auto pointNum = points.shape(0);
-
-        // add some commented header
-        auto now = std::chrono::system_clock::now();
-        auto now_t = std::chrono::system_clock::to_time_t( now );
-        swc << "# Created using reneu at " << std::ctime(&now_t) << 
-            "# https://github.com/jingpengw/reneu \n";
-
+        const std::string header = reneu::utils::make_swc_header();
+        const std::size_t pointNum = points.shape(0);
+        std::string swc( header.size() + 
+                        pointNum * reneu::utils::max_swc_line_size(precision), '\0' );
+        std::copy( header.begin(), header.end(), swc.begin() );
+        char *ptr = swc.data() + header.size();
         for (std::size_t pointIdx = 0; pointIdx<pointNum; pointIdx++ ){
             // index, class, x, y, z, r, parent
-            swc << pointIdx+1 << " " << classes(pointIdx) << " " 
-                << std::fixed << points(pointIdx, 0) << " " 
-                << std::fixed << points(pointIdx, 1) << " " 
-                << std::fixed << points(pointIdx, 2) << " " 
-                << std::fixed << points(pointIdx, 3) << " " 
-                << parents(pointIdx)+1 << "\n";
+            // the root parent is -2 here, and -1 in swc
+            ptr = reneu::utils::format_swc_line( ptr, pointIdx + 1, attributes(pointIdx, 0), 
+                        &points(pointIdx, 0), attributes(pointIdx, 1) + 1, precision );
         }
-
-        return swc.str();
+        swc.resize( ptr - swc.data() );
+        return swc;
     }
 
-    int write_swc( std::string file_name, const int precision = 3) const {
-        std::ofstream myfile (file_name, std::ios::out);
-        myfile.precision(precision);
-
-        if (myfile.is_open()){       
-            auto classes = get_classes();
-            auto parents = get_parents();
-            auto pointNum = points.shape(0);
-
-            // add some commented header
-            auto now = std::chrono::system_clock::now();
-            auto now_t = std::chrono::system_clock::to_time_t( now );
-            myfile << "# Created using reneu at " << std::ctime(&now_t) << 
-                "# https://github.com/jingpengw/reneu \n";
-
-            for (std::size_t pointIdx = 0; pointIdx<pointNum; pointIdx++ ){
-                // index, class, x, y, z, r, parent
-                myfile  << pointIdx+1 << " " << classes(pointIdx) << " " 
-                        << std::fixed << points(pointIdx, 0) << " " << std::fixed << points(pointIdx, 1) << " " 
-                        << std::fixed << points(pointIdx, 2) << " " << std::fixed << points(pointIdx, 3) << " " 
-                        << parents(pointIdx)+1 << "\n";
-            }
-        }else{
-            std::cout << "can not open file: " << file_name <<std::endl;
+    /**
+     * \brief write the SWC text to a file with a single write call.
+     */
+    void write_swc( const std::string &file_name, const int precision = 3 ) const {
+        const std::string swc = to_swc_str( precision );
+        std::ofstream myfile( file_name, std::ios::out | std::ios::binary );
+        if (!myfile.is_open()){
+            throw std::runtime_error( "can not open file: " + file_name );
+        }
+        myfile.write( swc.data(), swc.size() );
+        if (!myfile){
+            throw std::runtime_error( "failed to write file: " + file_name );
         }
-        return 0;
     }
 }; // Skeleton class
+
+/**
+ * \brief read SWC files in parallel. 
+ * A bad file is skipped and its error is reported, so it will not abort the batch.
+ * \param threadNum: the number of threads, 0 means all the hardware threads.
+ * \return the skeletons, their file names, and the error message of each bad file.
+ */
+inline auto read_swc_files( const std::vector<std::string> &fileNames, 
+                            const std::size_t &threadNum = 0 ){
+    const std::size_t fileNum = fileNames.size();
+    std::vector<std::optional<Skeleton>> loadedSkeletons( fileNum );
+    std::vector<std::string> messages( fileNum );
+    utils::parallel_for( fileNum, [&](const std::size_t &fileIdx){
+        try {
+            loadedSkeletons[ fileIdx ].emplace( fileNames[ fileIdx ] );
+        } catch (const std::exception &error){
+            messages[ fileIdx ] = error.what();
+        }
+    }, threadNum );
+
+    std::vector<Skeleton> skeletons;
+    std::vector<std::string> loadedFileNames;
+    std::map<std::string, std::string> errors;
+    skeletons.reserve( fileNum );
+    for (std::size_t fileIdx = 0; fileIdx < fileNum; fileIdx++){
+        if (loadedSkeletons[ fileIdx ]){
+            skeletons.push_back( std::move(*loadedSkeletons[ fileIdx ]) );
+            loadedFileNames.push_back( fileNames[ fileIdx ] );
+        } else {
+            errors[ fileNames[ fileIdx ] ] = messages[ fileIdx ];
+        }
+    }
+    return std::make_tuple( skeletons, loadedFileNames, errors );
+}
+
+/**
+ * \brief write skeletons to SWC files in parallel.
+ * A failed file will not abort the batch.
+ * \return the error message of each failed file.
+ */
+inline auto write_swc_files( const std::vector<Skeleton> &skeletons, 
+                             const std::vector<std::string> &fileNames, 
+                             const int &precision = 3, const std::size_t &threadNum = 0 ){
+    if (skeletons.size() != fileNames.size()){
+        throw std::runtime_error("the number of skeletons and file names are different.");
+    }
+    std::vector<std::string> messages( fileNames.size() );
+    utils::parallel_for( fileNames.size(), [&](const std::size_t &fileIdx){
+        try {
+            skeletons[ fileIdx ].write_swc( fileNames[ fileIdx ], precision );
+        } catch (const std::exception &error){
+            messages[ fileIdx ] = error.what();
+        }
+    }, threadNum );
+
+    std::map<std::string, std::string> errors;
+    for (std::size_t fileIdx = 0; fileIdx < fileNames.size(); fileIdx++){
+        if (!messages[ fileIdx ].empty()){
+            errors[ fileNames[ fileIdx ] ] = messages[ fileIdx ];
+        }
+    }
+    return errors;
+}
+
+/**
+ * \brief read all the SWC files in a directory in parallel, ordered by file name.
+ */
+inline auto read_swc_directory( const std::string &dirName, const std::size_t &threadNum = 0 ){
+    std::vector<std::string> fileNames;
+    for (const auto &entry : std::filesystem::directory_iterator( dirName )){
+        if (entry.is_regular_file() && entry.path().extension() == ".swc"){
+            fileNames.push_back( entry.path().string() );
+        }
+    }
+    std::sort( fileNames.begin(), fileNames.end() );
+    return read_swc_files( fileNames, threadNum );
+}
+
 } // namespace
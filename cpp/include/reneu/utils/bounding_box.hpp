@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+
 // #include "xtensor/xio.hpp"
 #include "xtensor/xfixed.hpp"
 #include "xtensor/xindex_view.hpp"
@@ -30,6 +32,27 @@ public:
 
     }
 
+    BoundingBox(const Points &points): corner(xt::zeros<float>({2, 3})){
+        for (Index i=0; i<3; i++){
+            auto coords = xt::view(points, xt::all(), i);
+            auto minmax = xt::minmax(coords)();
+            corner(0, i) = minmax[0];
+            corner(1, i) = minmax[1];
+        }
+    }
+
+    /**
+     * \param data: the min corner followed by the max corner
+     */
+    BoundingBox(const float *data): corner(xt::zeros<float>({2, 3})){
+        std::copy(data, data + 6, corner.begin());
+    }
+
+    // the min corner followed by the max corner
+    inline const float* data() const {
+        return corner.data();
+    }
+
     inline auto get_min_corner() const {
         return xt::view(corner, 0, xt::all());
     }
@@ -38,6 +61,18 @@ public:
         return xt::view(corner, 1, xt::all());
     }
 
+    /**
+     * \brief shrink the box to one side of a cut plane. 
+     * This is used to derive the box of child node from the parent node.
+     */
+    inline void set_min(const Index &dim, const float &value){
+        corner(0, dim) = value;
+    }
+
+    inline void set_max(const Index &dim, const float &value){
+        corner(1, dim) = value;
+    }
+
     auto get_largest_extent_dimension() const {
         auto minCorner = get_min_corner();
         auto maxCorner = get_max_corner();
@@ -69,6 +104,32 @@ public:
         return squaredDist;
     }
 
+    /**
+     * \brief the minimum squared distance between the points of two boxes.
+     */
+    float min_squared_distance_from( const BoundingBox &other ) const {
+        float squaredDist = 0;
+        for (Index i=0; i<3; i++){
+            const float gap = std::max({0.f, corner(0, i) - other.corner(1, i), 
+                                        other.corner(0, i) - corner(1, i)});
+            squaredDist += gap * gap;
+        }
+        return squaredDist;
+    }
+
+    /**
+     * \brief the same with above but works on raw floats.
+     * \param offsets: output the distance to the box along each axis.
+     */
+    float min_squared_distance_from( const float *point, float *offsets ) const {
+        float squaredDist = 0;
+        for (Index i=0; i<3; i++){
+            offsets[i] = std::max({0.f, corner(0, i) - point[i], point[i] - corner(1, i)});
+            squaredDist += offsets[i] * offsets[i];
+        }
+        return squaredDist;
+    }
+
 }; // end of class
 
 
@@ -3,19 +3,34 @@
 #include <limits>       // std::numeric_limits
 #include <iostream>
 #include <queue>
-#include <variant>
+#include <algorithm>    // std::nth_element
+#include <numeric>      // std::iota
+#include <future>
+#include <cmath>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
 #include "reneu/type_aliase.hpp"
 #include "xtensor/xview.hpp"
 #include "xtensor/xnorm.hpp"
 #include "xtensor/xsort.hpp"
 #include "xtensor/xindex_view.hpp"
+#include "xtensor/xmanipulation.hpp"
 
 #include "reneu/type_aliase.hpp"
 #include "reneu/utils/bounding_box.hpp"
+#include "reneu/utils/parallel.hpp"
+#include "reneu/utils/simd.hpp"
+#include "reneu/utils/mmap.hpp"
 
 namespace reneu{
 
-// namespace py=pybind11;
+namespace py=pybind11;
 using namespace xt::placeholders;
 
 using HeapElement = std::pair<float, Index>;
@@ -60,6 +75,21 @@ public:
         return pointIndices;
     }
 
+    /*
+     * pop the neighbors into one row of preallocated arrays.
+     * the order is the same with get_point_indices.
+     */
+    void pop_to(xt::xtensor<Index, 2> &pointIndices, xt::xtensor<float, 2> &squaredDists,
+                                                                const Index &row) {
+        const auto K = pqueue.size();
+        for(Index i=0; i<K; i++ ){
+            squaredDists(row, i) = pqueue.top().first;
+            pointIndices(row, i) = pqueue.top().second;
+            pqueue.pop();
+        }
+        assert( pqueue.empty() );
+    }
+
     void update(const float &squaredDist, const Index &pointIndex){
         if (squaredDist < max_squared_dist()){
             // replace the largest distance with current one
@@ -70,10 +100,246 @@ public:
 }; // end of class IndexHeap
 
 
+/*
+ * the result of 1-NN search, only one best candidate is tracked.
+ * this is the most common case in NBLAST.
+ */
+class NearestNeighbor{
+private:
+    float squaredDist;
+    Index pointIndex;
+
+public:
+    NearestNeighbor(const Index K = 1): squaredDist(std::numeric_limits<float>::max()),
+                    pointIndex(std::numeric_limits<Index>::max()){
+        assert( K == 1 );
+    }
+
+    inline auto size() const {
+        return 1;
+    }
+
+    inline auto max_squared_dist() const {
+        return squaredDist;
+    }
+
+    inline auto get_point_index() const {
+        return pointIndex;
+    }
+
+    inline auto get_point_indices() const {
+        PointIndices::shape_type sh = {1};
+        PointIndices pointIndices = xt::empty<Index>(sh);
+        pointIndices(0) = pointIndex;
+        return pointIndices;
+    }
+
+    inline void pop_to(xt::xtensor<Index, 2> &pointIndices, xt::xtensor<float, 2> &squaredDists,
+                                                                const Index &row) const {
+        squaredDists(row, 0) = squaredDist;
+        pointIndices(row, 0) = pointIndex;
+    }
+
+    inline void update(const float &squaredDist_, const Index &pointIndex_){
+        if (squaredDist_ < squaredDist){
+            squaredDist = squaredDist_;
+            pointIndex = pointIndex_;
+        }
+    }
+}; // end of class NearestNeighbor
+
+
+/*
+ * the result of small K search. 
+ * The candidates are kept sorted in a fixed size array, 
+ * and a new one is inserted by shifting the farther ones. 
+ * For small K this is faster than a heap and do not allocate memory.
+ * \tparam N: the capacity, K should not be larger than N.
+ */
+template<Index N>
+class SortedNeighbors{
+private:
+    const Index K;
+    // sorted from nearest to farthest
+    std::array<float, N> squaredDists;
+    std::array<Index, N> pointIndices;
+
+public:
+    SortedNeighbors(const Index K_): K(K_){
+        assert( K>0 && K<=N );
+        squaredDists.fill( std::numeric_limits<float>::max() );
+        pointIndices.fill( std::numeric_limits<Index>::max() );
+    }
+
+    inline auto size() const {
+        return K;
+    }
+
+    inline auto max_squared_dist() const {
+        return squaredDists[K-1];
+    }
+
+    // the order is farthest first, the same with IndexHeap
+    auto get_point_indices() const {
+        PointIndices::shape_type sh = {K};
+        PointIndices ret = xt::empty<Index>(sh);
+        for(Index i=0; i<K; i++){
+            ret(i) = pointIndices[K-1-i];
+        }
+        return ret;
+    }
+
+    void pop_to(xt::xtensor<Index, 2> &pointIndices_, xt::xtensor<float, 2> &squaredDists_,
+                                                                const Index &row) const {
+        for(Index i=0; i<K; i++){
+            squaredDists_(row, i) = squaredDists[K-1-i];
+            pointIndices_(row, i) = pointIndices[K-1-i];
+        }
+    }
+
+    inline void update(const float &squaredDist, const Index &pointIndex){
+        if (squaredDist < max_squared_dist()){
+            // shift the farther candidates and insert the new one
+            Index i = K-1;
+            for (; i>0 && squaredDists[i-1] > squaredDist; i--){
+                squaredDists[i] = squaredDists[i-1];
+                pointIndices[i] = pointIndices[i-1];
+            }
+            squaredDists[i] = squaredDist;
+            pointIndices[i] = pointIndex;
+        }
+    }
+}; // end of class SortedNeighbors
+
+// K not larger than this uses sorted array rather than heap
+const Index SMALL_K = 16;
+
+
+/*
+ * collect all the points within a radius.
+ */
+class RadiusNeighbors{
+private:
+    const float squaredRadius;
+    // the points on the sphere are included, so the cells touching 
+    // the sphere should not be pruned.
+    const float bound;
+    std::vector<Index> pointIndices;
+    std::vector<float> squaredDists;
+
+public:
+    RadiusNeighbors(const float &radius): squaredRadius(radius * radius), 
+        bound(std::nextafter(radius * radius, std::numeric_limits<float>::max())){}
+
+    inline auto size() const {
+        return pointIndices.size();
+    }
+
+    inline auto max_squared_dist() const {
+        return bound;
+    }
+
+    inline auto get_point_indices() const {
+        PointIndices::shape_type sh = {pointIndices.size()};
+        PointIndices ret = xt::empty<Index>(sh);
+        std::copy(pointIndices.begin(), pointIndices.end(), ret.begin());
+        return ret;
+    }
+
+    // in the same order with point indices
+    inline auto get_squared_dists() const {
+        xt::xtensor<float, 1>::shape_type sh = {squaredDists.size()};
+        xt::xtensor<float, 1> ret = xt::empty<float>(sh);
+        std::copy(squaredDists.begin(), squaredDists.end(), ret.begin());
+        return ret;
+    }
+
+    inline void update(const float &squaredDist, const Index &pointIndex){
+        if (squaredDist <= squaredRadius){
+            pointIndices.push_back( pointIndex );
+            squaredDists.push_back( squaredDist );
+        }
+    }
+}; // end of class RadiusNeighbors
+
+/*
+ * only count the points within a radius without storing them.
+ */
+class RadiusCounter{
+private:
+    const float squaredRadius;
+    const float bound;
+    Index count;
+
+public:
+    RadiusCounter(const float &radius): squaredRadius(radius * radius), 
+        bound(std::nextafter(radius * radius, std::numeric_limits<float>::max())), 
+        count(0){}
+
+    inline auto size() const {
+        return count;
+    }
+
+    inline auto max_squared_dist() const {
+        return bound;
+    }
+
+    inline void update(const float &squaredDist, const Index &){
+        if (squaredDist <= squaredRadius){
+            count++;
+        }
+    }
+}; // end of class RadiusCounter
+
+
 
 // the maximum dim is 2, so two bits is enough to encode the dimension
 const std::uint32_t DIM_BIT_START = 30;
 
+// number of consecutive query points handed to a thread in batch query
+const std::size_t KNN_BATCH_GRAIN_SIZE = 64;
+
+// subtrees smaller than this are built in the current thread
+const Index PARALLEL_BUILD_MIN_POINT_NUM = 1<<15;
+
+// the leaf points are scanned in chunks of this size 
+const Index LEAF_CHUNK_SIZE = 32;
+
+// the tree is balanced and the point number is 32 bits, 
+// so the depth can not be larger than this.
+const Index MAX_KD_TREE_DEPTH = 64;
+
+/*
+ * the error and time budget of approximate search.
+ * the default is exact search.
+ */
+struct SearchBudget{
+    // the cells farther than the current k-th distance divided by (1+epsilon) are pruned.
+    float epsilon;
+    // stop after scanning this number of leaves.
+    Index maxLeafNum;
+    // output: the number of scanned leaves.
+    Index leafNum;
+
+    SearchBudget(const float &epsilon_ = 0, 
+                    const Index &maxLeafNum_ = std::numeric_limits<Index>::max()):
+        epsilon(epsilon_), maxLeafNum(maxLeafNum_), leafNum(0){
+        assert( epsilon >= 0 );
+        assert( maxLeafNum > 0 );
+    }
+};
+
+/*
+ * a node waiting for search.
+ */
+struct KDTreeSearchCell{
+    Index nodeIndex;
+    // the squared distance from query point to the node cell
+    float squaredDist;
+    // the distance from query point to the node cell along each axis
+    float offsets[3];
+};
+
 /*
 * This implementation is inspired by libnabo:
 * https://github.com/ethz-asl/libnabo
@@ -81,6 +347,12 @@ const std::uint32_t DIM_BIT_START = 30;
 * this design will avoid class inheritance and virtual functions, smart pointers...
 * this is more efficient according to libnabo paper:
 * Elseberg, Jan, et al. "Comparison of nearest-neighbor-search strategies and implementations for efficient shape registration." Journal of Software Engineering for Robotics 3.1 (2012): 2-12.
+* 
+* The node is packed into 8 bytes, so 8 nodes fit in one cache line.
+* The bounding box is not stored in the node. It is derived from the 
+* root bounding box and the cut values while descending the tree.
+* The nodes are stored in depth-first order, the left child is always 
+* the next node, so a descent walks the node array forward.
 */
 class KDTreeNode{
 private:
@@ -93,15 +365,18 @@ private:
     // if this is a leaf node, the 30 least-significant bits encode 
     // the number of points in bucket.
     Index dim_child_bucketSize;
-    // the starting index of points in bucket
-    // the cut/split value of this node
-    std::variant<Index, float> bucketStart_cutValue;
-    BoundingBox bbox;
+    union {
+        // the starting index of points in bucket of a leaf node
+        Index bucketStart;
+        // the cut/split value of a split node
+        float cutValue;
+    };
 
 public:
+    KDTreeNode() = default;
+
     // construct a split node
-    KDTreeNode(const Index dim, const float cutValue_, const BoundingBox bbox_):
-                        bucketStart_cutValue(cutValue_), bbox(bbox_){
+    KDTreeNode(const Index dim, const float cutValue_): cutValue(cutValue_){
         // since dim is unsigned type, it is always >=0
         assert(dim<3);
         dim_child_bucketSize = dim << DIM_BIT_START;
@@ -109,17 +384,12 @@ public:
     }
 
     // construct a leaf node
-    KDTreeNode(const Index bucketStart_, const Index bucketSize, const BoundingBox bbox_):
-                                    bucketStart_cutValue(bucketStart_), bbox(bbox_){
+    KDTreeNode(const Index bucketStart_, const Index bucketSize): bucketStart(bucketStart_){
         dim_child_bucketSize = (3<<DIM_BIT_START) + bucketSize;
     }
 
-    inline auto get_bounding_box() const {
-        return bbox;
-    }    
-
     inline auto get_bucket_start() const {
-        return std::get<Index>(bucketStart_cutValue);
+        return bucketStart;
     }
     
     inline auto get_bucket_size() const {
@@ -132,7 +402,7 @@ public:
     }
 
     inline auto get_cut_value() const {
-        return std::get<float>(bucketStart_cutValue);
+        return cutValue;
     }
 
     inline auto get_dim() const {
@@ -168,6 +438,160 @@ public:
 
 }; // end of class KDTreeNode
 
+static_assert( sizeof(KDTreeNode) == 8, "KDTreeNode should be packed into 8 bytes." );
+
+
+/*
+ * the leaf points stored in float, structure of arrays in bucket order.
+ * This is the leaf decoder of KDTree, other point storages could reuse 
+ * the search of search_kd_tree_nodes with their own decoders.
+ */
+struct KDTreeLeafPoints{
+    const float *xs;
+    const float *ys;
+    const float *zs;
+    const Index *pointIndicesBucket;
+
+    /*
+     * \param chunkSize: not larger than LEAF_CHUNK_SIZE
+     * \param squaredDists: output, the squared distances of points in the chunk
+     */
+    inline void squared_distances(const float *queryPoint, const Index &chunkStart, 
+                                const Index &chunkSize, float *squaredDists) const {
+        utils::squared_distances( xs + chunkStart, ys + chunkStart, zs + chunkStart, 
+                                    chunkSize, queryPoint, squaredDists );
+    }
+
+    inline Index get_point_index(const Index &bucketIndex) const {
+        return pointIndicesBucket[bucketIndex];
+    }
+};
+
+/*
+ * depth-first search with an explicit stack.
+ * we always walk down to the nearer child and push the farther one.
+ * the squared distance from the query point to the cell of a node is 
+ * updated incrementally from the cut plane, following
+ * Arya, Sunil, and David M. Mount. "Algorithms for fast vector quantization." 
+ * Proceedings DCC'93: Data Compression Conference. IEEE, 1993.
+ * Only the offset along the cut dimension changes, so pruning a node 
+ * costs a few float operations rather than a full box distance.
+ * \tparam LeafPoints: the decoder of leaf points, see KDTreeLeafPoints
+ * \param nodes: the tree nodes in depth-first order
+ * \param rootBox: the bounding box of root node in the coordinate of cut values
+ */
+template<class LeafPoints, class Neighbors>
+inline void search_kd_tree_nodes( const KDTreeNode *nodes, const BoundingBox &rootBox, 
+                            const LeafPoints &leafPoints, const float *queryPoint, 
+                            Neighbors &neighbors, SearchBudget &budget ){
+    // prune the cells farther than the current k-th distance divided by (1+epsilon)
+    const float scale = (1.f + budget.epsilon) * (1.f + budget.epsilon);
+    budget.leafNum = 0;
+
+    std::array<KDTreeSearchCell, MAX_KD_TREE_DEPTH> stack;
+    Index stackSize = 0;
+    std::array<float, LEAF_CHUNK_SIZE> squaredDists;
+
+    KDTreeSearchCell &rootCell = stack[stackSize++];
+    rootCell.nodeIndex = 0;
+    rootCell.squaredDist = rootBox.min_squared_distance_from( queryPoint, rootCell.offsets );
+
+    while (stackSize > 0){
+        KDTreeSearchCell cell = stack[--stackSize];
+        if (cell.squaredDist * scale >= neighbors.max_squared_dist()){
+            continue;
+        }
+
+        const KDTreeNode *node = &nodes[cell.nodeIndex];
+        while (!node->is_leaf()){
+            // this is a split node
+            const auto dim = node->get_dim();
+            const float diff = queryPoint[dim] - node->get_cut_value();
+            Index nearNodeIndex, farNodeIndex;
+            if (diff < 0){
+                // left child node is closer
+                nearNodeIndex = cell.nodeIndex + 1;
+                farNodeIndex = node->get_right_child_node_index();
+            } else {
+                // right child node is closer
+                nearNodeIndex = node->get_right_child_node_index();
+                farNodeIndex = cell.nodeIndex + 1;
+            }
+
+            // the nearer child has the same distance with current cell
+            // only the offset in cut dimension changes for the farther one
+            KDTreeSearchCell &farCell = stack[stackSize];
+            farCell = cell;
+            farCell.nodeIndex = farNodeIndex;
+            farCell.squaredDist += diff * diff - cell.offsets[dim] * cell.offsets[dim];
+            farCell.offsets[dim] = diff;
+            if (farCell.squaredDist * scale < neighbors.max_squared_dist()){
+                // the stack is sorted by depth, so it will never be deeper than the tree
+                stackSize++;
+                assert( stackSize < MAX_KD_TREE_DEPTH );
+            }
+
+            cell.nodeIndex = nearNodeIndex;
+            node = &nodes[nearNodeIndex];
+        }
+
+        // this is a leaf node
+        // compute the distances of a chunk of points with SIMD kernel
+        const Index bucketStop = node->get_bucket_stop();
+        for(Index chunkStart = node->get_bucket_start(); chunkStart<bucketStop; 
+                                                    chunkStart += LEAF_CHUNK_SIZE){
+            const Index chunkSize = std::min(LEAF_CHUNK_SIZE, bucketStop - chunkStart);
+            leafPoints.squared_distances( queryPoint, chunkStart, chunkSize, 
+                                                            squaredDists.data() );
+            for (Index i=0; i<chunkSize; i++){
+                neighbors.update( squaredDists[i], leafPoints.get_point_index(chunkStart + i) );
+            }
+        }
+
+        budget.leafNum++;
+        if (budget.leafNum >= budget.maxLeafNum){
+            // run out of budget, the result is approximate
+            return;
+        }
+    }
+}
+
+
+/*
+ * the header of the binary format of KDTree.
+ * The binary layout is the same with the memory layout used by search,
+ * all the sections are aligned to cache lines:
+ *      header | nodes | point indices bucket | points bucket (3 x N)
+ * so a tree can be used directly from a memory mapped file.
+ */
+struct KDTreeHeader{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t leafSize;
+    std::uint32_t pointNum;
+    std::uint32_t nodeNum;
+    // the min corner followed by the max corner
+    float boundingBox[6];
+    // the offsets of sections from the start of header
+    std::uint64_t nodesOffset;
+    std::uint64_t pointIndicesOffset;
+    std::uint64_t pointsOffset;
+    // the total size including the padding
+    std::uint64_t size;
+};
+
+const char KD_TREE_MAGIC[8] = {'R', 'E', 'N', 'E', 'U', 'K', 'D', 'T'};
+const std::uint32_t KD_TREE_FORMAT_VERSION = 1;
+
+/*
+ * the memory of a tree built in this process.
+ */
+struct KDTreeBuffers{
+    std::vector<KDTreeNode> nodes;
+    std::vector<Index> pointIndices;
+    // structure of arrays (3 x N)
+    std::vector<float> points;
+};
 
 class KDTree{
 
@@ -175,203 +599,829 @@ private:
     using KDTreeNodes = std::vector<KDTreeNode>;
     using PointIndicesBucket = std::vector<Index>;
 
-    KDTreeNodes kdTreeNodes;
-    PointIndicesBucket pointIndicesBucket;
-    Points pointsBucket;
     const Index leafSize;
+    Index pointNum;
+    Index nodeNum;
+    // the bounding box of all the points.
+    // the boxes of other nodes are derived from it by the cut planes.
+    BoundingBox boundingBox;
+    // the owner of the memory of nodes and buckets. It is either the 
+    // buffers of a tree built in this process or a memory mapped file.
+    // the memory is never modified after construction, 
+    // so the copies of a tree can share it.
+    std::shared_ptr<const void> storage;
+    const KDTreeNode *kdTreeNodes;
+    const Index *pointIndicesBucket;
+    // the points are stored as structure of arrays (3 x N) in bucket order,
+    // so the coordinates of a leaf are contiguous for SIMD kernels.
+    const float *pointsBucket;
+
+    /*
+     * the tight boxes of nodes used by dual tree search.
+     * they are computed once on first use and shared by the copies of a tree,
+     * since the nodes and points are never modified after construction.
+     */
+    struct NodeBoxes{
+        std::once_flag flag;
+        std::vector<float> boxes;
+    };
+    std::shared_ptr<NodeBoxes> nodeBoxes = std::make_shared<NodeBoxes>();
+
+    static const KDTreeHeader& check_header(const char *data, const std::size_t &size){
+        if (size < sizeof(KDTreeHeader)){
+            throw std::runtime_error("the data is too small to be a kd tree.");
+        }
+        if (reinterpret_cast<std::uintptr_t>(data) % alignof(KDTreeHeader) != 0){
+            throw std::runtime_error("the kd tree data is not aligned.");
+        }
+        const auto &header = *reinterpret_cast<const KDTreeHeader*>(data);
+        if (std::memcmp(header.magic, KD_TREE_MAGIC, sizeof(KD_TREE_MAGIC)) != 0){
+            throw std::runtime_error("the data is not a kd tree.");
+        }
+        if (header.version != KD_TREE_FORMAT_VERSION){
+            throw std::runtime_error("unsupported kd tree format version: " + 
+                                        std::to_string(header.version));
+        }
+        if (header.size > size){
+            throw std::runtime_error("the kd tree data is truncated.");
+        }
+        if (!utils::is_valid_section<KDTreeNode>(header.nodesOffset, header.nodeNum, header.size) || 
+                !utils::is_valid_section<Index>(header.pointIndicesOffset, header.pointNum, 
+                                                                            header.size) || 
+                !utils::is_valid_section<float>(header.pointsOffset, 
+                                        3 * std::uint64_t(header.pointNum), header.size)){
+            throw std::runtime_error("the kd tree data is corrupted.");
+        }
+        return header;
+    }
+
+    static const std::size_t& check_offset(const std::size_t &offset, const std::size_t &size){
+        if (offset > size){
+            throw std::runtime_error("the kd tree offset is out of the file.");
+        }
+        return offset;
+    }
+
+    KDTree( const KDTreeHeader &header, const char *data, 
+                                    const std::shared_ptr<const void> &owner ):
+        leafSize(header.leafSize), pointNum(header.pointNum), nodeNum(header.nodeNum), 
+        boundingBox(header.boundingBox), storage(owner),
+        kdTreeNodes(reinterpret_cast<const KDTreeNode*>(data + header.nodesOffset)),
+        pointIndicesBucket(reinterpret_cast<const Index*>(data + header.pointIndicesOffset)),
+        pointsBucket(reinterpret_cast<const float*>(data + header.pointsOffset)){
+        check_nodes();
+    }
+
+    /*
+     * check the nodes and point indices read from binary data in one linear pass, 
+     * so a corrupted file throws rather than reading out of bounds in search.
+     * The children always follow their parent in the node array, 
+     * so the depths of nodes are derived in the same pass.
+     */
+    void check_nodes() const {
+        if (nodeNum == 0){
+            throw std::runtime_error("the kd tree has no root node.");
+        }
+        std::vector<std::uint8_t> depths( nodeNum, 0 );
+        for (Index nodeIndex=0; nodeIndex<nodeNum; nodeIndex++){
+            const KDTreeNode &node = kdTreeNodes[nodeIndex];
+            if (node.is_leaf()){
+                // the leaves are empty only in a tree without points
+                if (std::uint64_t(node.get_bucket_start()) + node.get_bucket_size() > pointNum || 
+                        (node.get_bucket_size() == 0 && pointNum > 0)){
+                    throw std::runtime_error("the kd tree has a bucket out of points.");
+                }
+                continue;
+            }
+            // the two dimension bits of a split node are always 0-2, 3 means leaf.
+            const Index rightNodeIndex = node.get_right_child_node_index();
+            if (nodeIndex + 1 >= nodeNum || rightNodeIndex <= nodeIndex || 
+                                                    rightNodeIndex >= nodeNum){
+                throw std::runtime_error("the kd tree has a child node out of order.");
+            }
+            // the search stack is as deep as the tree
+            const std::uint8_t childDepth = depths[nodeIndex] + 1;
+            if (childDepth >= MAX_KD_TREE_DEPTH){
+                throw std::runtime_error("the kd tree is too deep.");
+            }
+            depths[nodeIndex + 1] = std::max(depths[nodeIndex + 1], childDepth);
+            depths[rightNodeIndex] = std::max(depths[rightNodeIndex], childDepth);
+        }
+        for (Index bucketIndex=0; bucketIndex<pointNum; bucketIndex++){
+            if (pointIndicesBucket[bucketIndex] >= pointNum){
+                throw std::runtime_error("the kd tree has a point index out of points.");
+            }
+        }
+    }
+
+    void set_buffers( const std::shared_ptr<KDTreeBuffers> &buffers ){
+        pointNum = buffers->pointIndices.size();
+        nodeNum = buffers->nodes.size();
+        kdTreeNodes = buffers->nodes.data();
+        pointIndicesBucket = buffers->pointIndices.data();
+        pointsBucket = buffers->points.data();
+        storage = buffers;
+    }
+
+    inline bool is_leaf_point_num( const Index &pointNum ) const {
+        return pointNum <= leafSize || pointNum <= 1;
+    }
+
+    /*
+     * the number of nodes of a subtree containing pointNum points.
+     * the split always happens at the median, so the node layout is 
+     * determined by the point number only. We can allocate all the nodes 
+     * beforehand and build the subtrees into their own slots in parallel.
+     */
+    Index count_nodes( const Index &pointNum ) const {
+        if (is_leaf_point_num(pointNum)){
+            return 1;
+        }
+        const Index leftPointNum = pointNum / 2;
+        return 1 + count_nodes(leftPointNum) + count_nodes(pointNum - leftPointNum);
+    }
 
-    Index build_kd_nodes( const Points &points, const PointIndices &pointIndices ){
-        BoundingBox bbox( points, pointIndices );
-        if (pointIndices.size() <= leafSize ){
+    /*
+     * build the subtree of points in pointIndicesBucket[start, stop) into node nodeIndex.
+     * the point indices are partitioned in place, so no temporary buffer is needed.
+     * the bounding box is derived from the parent split rather than the points.
+     * \param parallelDepth: the subtrees will be built in parallel if larger than 0.
+     */
+    void build_kd_nodes( KDTreeBuffers &buffers, const Points &points, 
+                            const Index &start, const Index &stop, 
+                            const Index &nodeIndex, const BoundingBox &bbox, 
+                            const Index &parallelDepth ) const {
+        const Index pointNum = stop - start;
+        auto &pointIndicesBucket = buffers.pointIndices;
+        const Index bucketSize = pointIndicesBucket.size();
+        if (is_leaf_point_num(pointNum)){
             // build a leaf node
-            Index bucketSize = pointIndices.size();
-            Index bucketStart = pointIndicesBucket.size();
-            KDTreeNode node( bucketStart, bucketSize, bbox );
-
-            Index bucketIndex, pointIndex;
-            for (Index i=0; i<bucketSize; i++){
-                pointIndex = pointIndices(i);
-                pointIndicesBucket.push_back( pointIndices(i) );
-
-                bucketIndex = bucketStart + i;
-                pointsBucket( bucketIndex, 0 ) = points(pointIndex, 0);
-                pointsBucket( bucketIndex, 1 ) = points(pointIndex, 1);
-                pointsBucket( bucketIndex, 2 ) = points(pointIndex, 2);
+            buffers.nodes[nodeIndex] = KDTreeNode( start, pointNum );
+
+            for (Index bucketIndex=start; bucketIndex<stop; bucketIndex++){
+                const auto pointIndex = pointIndicesBucket[bucketIndex];
+                buffers.points[ bucketIndex ] = points(pointIndex, 0);
+                buffers.points[ bucketSize + bucketIndex ] = points(pointIndex, 1);
+                buffers.points[ 2*bucketSize + bucketIndex ] = points(pointIndex, 2);
             }
+            return;
+        } 
 
-            // std::cout<< "\ninserting leaf node to " << kdTreeNodes.size() << std::endl;
-            // node.print();
-            // std::cout<<"\nexisting nodes in kdTreeNodes: "<<std::endl;
-            // for(auto n : kdTreeNodes){
-                // n.print();
-            // }
+        // build a split node
+        const Index dim = bbox.get_largest_extent_dimension();
+        
+        // find the median value index
+        // partition can save some computation than full sort
+        const Index splitIndex = start + pointNum / 2;
+        auto first = pointIndicesBucket.begin();
+        std::nth_element( first + start, first + splitIndex, first + stop, 
+            [&points, &dim](const Index &left, const Index &right){
+                return points(left, dim) < points(right, dim);
+            });
+        const float cutValue = points( pointIndicesBucket[splitIndex], dim );
+        
+        const Index leftNodeIndex = nodeIndex + 1;
+        const Index rightNodeIndex = leftNodeIndex + count_nodes( splitIndex - start );
+        buffers.nodes[nodeIndex] = KDTreeNode( dim, cutValue );
+        buffers.nodes[nodeIndex].write_right_child_node_index( rightNodeIndex );
+
+        // the points in left child are not larger than cut value
+        // and the points in right child are not smaller than cut value
+        BoundingBox leftBoundingBox = bbox;
+        leftBoundingBox.set_max(dim, cutValue);
+        BoundingBox rightBoundingBox = bbox;
+        rightBoundingBox.set_min(dim, cutValue);
 
-            kdTreeNodes.push_back( node );
-            return kdTreeNodes.size() - 1;
+        if (parallelDepth > 0 && pointNum >= PARALLEL_BUILD_MIN_POINT_NUM){
+            // the two subtrees write to disjoint nodes and buckets
+            auto leftTask = std::async(std::launch::async, [&](){
+                build_kd_nodes( buffers, points, start, splitIndex, leftNodeIndex, 
+                                leftBoundingBox, parallelDepth - 1 );
+            });
+            build_kd_nodes( buffers, points, splitIndex, stop, rightNodeIndex, 
+                                rightBoundingBox, parallelDepth - 1 );
+            leftTask.get();
         } else {
-            // build a split node
-            auto dim = bbox.get_largest_extent_dimension();
-            auto pointNum = pointIndices.size();
-            
-            // find the median value index
-            xt::xtensor<float, 1> coords = xt::index_view( 
-                            xt::view(points, xt::all(), dim), 
-                            pointIndices);
-            const Index splitIndex = pointNum / 2;
-            // partition can save some computation than full sort
-            const auto argSortIndices = xt::argpartition(coords, splitIndex);
-            // auto argSortIndices = xt::argsort( coords );
-            const PointIndices sortedPointIndices = xt::index_view( 
-                                                pointIndices, argSortIndices );
-            const auto middlePointIndex = sortedPointIndices( splitIndex );
-            const float cutValue = points( middlePointIndex, dim );
-             
-            // std::cout<< "dim: " << dim << std::endl;
-            // std::cout<< "point number: " << pointNum << std::endl;
-            // std::cout<< "middle point index: " << middlePointIndex << std::endl;
-
-           
-            KDTreeNode node(dim, cutValue, bbox);
-            // node.print();
-            Index nodeIndex = kdTreeNodes.size();
-            kdTreeNodes.push_back(node);
-
-            const auto leftPointIndices = xt::view( sortedPointIndices, 
-                                                        xt::range(0, splitIndex) );
-            const auto leftNodeIndex = build_kd_nodes(points, leftPointIndices);
-            assert( leftNodeIndex == nodeIndex + 1 );
-
-            const auto rightPointIndices = xt::view( sortedPointIndices, 
-                                                        xt::range(splitIndex, _) );
-            const auto rightNodeIndex = build_kd_nodes(points, rightPointIndices);
-
-            kdTreeNodes[nodeIndex].write_right_child_node_index( rightNodeIndex );
-            return nodeIndex;
-        }
-    }
-
-    void knn_update_heap( const Point &queryPoint, IndexHeap &indexHeap, 
-                                        const Index &nodeIndex) const {
-        KDTreeNode node = kdTreeNodes[nodeIndex];
-        
-        // check the bounding box first
-        BoundingBox bbox = node.get_bounding_box();
-        if (indexHeap.max_squared_dist() < bbox.min_squared_distance_from( queryPoint )){
-            return;
+            build_kd_nodes( buffers, points, start, splitIndex, leftNodeIndex, leftBoundingBox, 0 );
+            build_kd_nodes( buffers, points, splitIndex, stop, rightNodeIndex, rightBoundingBox, 0 );
         }
+    }
+
+    /*
+     * the search over tree nodes is shared with other point storages, 
+     * see search_kd_tree_nodes.
+     */
+    template<class Neighbors>
+    inline void update_neighbors( const float *queryPoint, Neighbors &neighbors, 
+                                                SearchBudget &budget ) const {
+        const KDTreeLeafPoints leafPoints = {pointsBucket, pointsBucket + pointNum, 
+                                        pointsBucket + 2*pointNum, pointIndicesBucket};
+        search_kd_tree_nodes( kdTreeNodes, boundingBox, leafPoints, 
+                                                queryPoint, neighbors, budget );
+    }
 
+    // exact search
+    template<class Neighbors>
+    inline void update_neighbors( const float *queryPoint, Neighbors &neighbors ) const {
+        SearchBudget budget;
+        update_neighbors( queryPoint, neighbors, budget );
+    }
+
+    /*
+     * the tight boxes of all the nodes computed bottom up. 
+     * the boxes derived from cut planes could be much larger than 
+     * the points inside, which is too loose for pruning node pairs.
+     * \param boxes: the min corner followed by the max corner of each node
+     */
+    void compute_node_boxes(const Index &nodeIndex, std::vector<float> &boxes) const {
+        float *box = boxes.data() + 6*nodeIndex;
+        const KDTreeNode &node = kdTreeNodes[nodeIndex];
         if (node.is_leaf()){
-            Index bucketStart = node.get_bucket_start(); 
-            Index bucketStop = node.get_bucket_stop();
-            auto leafPoints = xt::view(pointsBucket, 
-                            xt::range(bucketStart, bucketStop), xt::all());
-            // Points minusPoints = leafPoints - queryPoint; 
-            // xt::xtensor<float, 1> squaredDistances = xt::norm_sq( leafPoints - queryPoint, 1.0, xt::evaluation_strategy::immediate)();
-
-            // std::cout<< "leafPoints - queryPoint: " << (leafPoints - queryPoint) << std::endl;
-            // std::cout<< "squared distances: " << squaredDistances << std::endl;
-            // std::cout<< "bucket start: " << bucketStart << ", bucket stop: "<< bucketStop << 
-                        // ", size: "<< bucketStop - bucketStart << std::endl;
-
-            Index pointIndex;
-            float squaredDist;
-            for(Index i=0; i<node.get_bucket_size(); i++){
-                pointIndex = pointIndicesBucket[ i + bucketStart ];
-                auto point = xt::view(leafPoints, i, xt::all());
-                squaredDist = xt::norm_sq( point - queryPoint )();
-                indexHeap.update( squaredDist, pointIndex );
+            for (Index dim=0; dim<3; dim++){
+                const float *coords = pointsBucket + dim*pointNum;
+                const auto [minIt, maxIt] = std::minmax_element( 
+                        coords + node.get_bucket_start(), coords + node.get_bucket_stop() );
+                box[dim] = *minIt;
+                box[3 + dim] = *maxIt;
             }
+            return;
+        }
+
+        const Index leftNodeIndex = nodeIndex + 1;
+        const Index rightNodeIndex = node.get_right_child_node_index();
+        compute_node_boxes( leftNodeIndex, boxes );
+        compute_node_boxes( rightNodeIndex, boxes );
+        const float *leftBox = boxes.data() + 6*leftNodeIndex;
+        const float *rightBox = boxes.data() + 6*rightNodeIndex;
+        for (Index dim=0; dim<3; dim++){
+            box[dim] = std::min(leftBox[dim], rightBox[dim]);
+            box[3 + dim] = std::max(leftBox[3 + dim], rightBox[3 + dim]);
+        }
+    }
+
+    /*
+     * \return the min corner followed by the max corner of each node
+     */
+    const std::vector<float>& get_node_boxes() const {
+        std::call_once( nodeBoxes->flag, [this](){
+            nodeBoxes->boxes.resize( 6 * nodeNum );
+            compute_node_boxes( 0, nodeBoxes->boxes );
+        });
+        return nodeBoxes->boxes;
+    }
+
+    static inline float box_squared_distance(const float *box1, const float *box2){
+        float squaredDist = 0;
+        for (Index dim=0; dim<3; dim++){
+            const float gap = std::max({0.f, box1[dim] - box2[3 + dim], 
+                                        box2[dim] - box1[3 + dim]});
+            squaredDist += gap * gap;
+        }
+        return squaredDist;
+    }
+
+    static inline float point_box_squared_distance(const float *point, const float *box){
+        float squaredDist = 0;
+        for (Index dim=0; dim<3; dim++){
+            const float gap = std::max({0.f, box[dim] - point[dim], point[dim] - box[3 + dim]});
+            squaredDist += gap * gap;
+        }
+        return squaredDist;
+    }
+
+    /*
+     * the state of dual tree search. 
+     * the arrays of query points are in the bucket order of query tree.
+     */
+    struct DualTreeState{
+        std::vector<float> squaredDists;
+        std::vector<Index> pointIndices;
+        // the largest nearest distance of query points in each query node
+        std::vector<float> bounds;
+        // the cached boxes of trees, not copied
+        const std::vector<float> &queryBoxes;
+        const std::vector<float> &targetBoxes;
+        std::array<float, LEAF_CHUNK_SIZE> chunkSquaredDists;
+
+        DualTreeState(const KDTree &queryTree, const KDTree &targetTree):
+            squaredDists(queryTree.pointNum, std::numeric_limits<float>::max()),
+            pointIndices(queryTree.pointNum, std::numeric_limits<Index>::max()),
+            bounds(queryTree.nodeNum, std::numeric_limits<float>::max()),
+            queryBoxes(queryTree.get_node_boxes()),
+            targetBoxes(targetTree.get_node_boxes()){}
+    };
+
+    /*
+     * find the nearest neighbors of all the points in a query node 
+     * from the points in a target node of this tree. 
+     * A pair of nodes is pruned if their boxes are farther than the 
+     * largest nearest distance found so far in the query node.
+     */
+    void dual_tree_search( const KDTree &queryTree, const Index &queryNodeIndex, 
+                    const Index &targetNodeIndex, DualTreeState &state ) const {
+        const float *queryBox = state.queryBoxes.data() + 6*queryNodeIndex;
+        const float *targetBox = state.targetBoxes.data() + 6*targetNodeIndex;
+        if (box_squared_distance(queryBox, targetBox) >= state.bounds[queryNodeIndex]){
+            return;
+        }
+
+        const KDTreeNode &queryNode = queryTree.kdTreeNodes[queryNodeIndex];
+        const KDTreeNode &targetNode = kdTreeNodes[targetNodeIndex];
+
+        if (queryNode.is_leaf() && targetNode.is_leaf()){
+            // compare all the point pairs
+            const Index queryPointNum = queryTree.pointNum;
+            const float *queryXs = queryTree.pointsBucket;
+            const float *xs = pointsBucket;
+            float bound = 0;
+            float minSquaredDist = std::numeric_limits<float>::max();
+            for (Index queryBucketIndex = queryNode.get_bucket_start(); 
+                        queryBucketIndex < queryNode.get_bucket_stop(); queryBucketIndex++){
+                const float queryPoint[3] = {
+                    queryXs[ queryBucketIndex ], 
+                    queryXs[ queryPointNum + queryBucketIndex ], 
+                    queryXs[ 2*queryPointNum + queryBucketIndex ]};
+                float &bestSquaredDist = state.squaredDists[queryBucketIndex];
+                Index &bestPointIndex = state.pointIndices[queryBucketIndex];
+
+                // the other points of query leaf might be close to the target leaf,
+                // but this one is not.
+                if (point_box_squared_distance(queryPoint, targetBox) < bestSquaredDist){
+                    const Index bucketStop = targetNode.get_bucket_stop();
+                    for(Index chunkStart = targetNode.get_bucket_start(); chunkStart<bucketStop; 
+                                                                chunkStart += LEAF_CHUNK_SIZE){
+                        const Index chunkSize = std::min(LEAF_CHUNK_SIZE, bucketStop - chunkStart);
+                        utils::squared_distances( xs + chunkStart, xs + pointNum + chunkStart, 
+                                                xs + 2*pointNum + chunkStart, chunkSize, 
+                                                queryPoint, state.chunkSquaredDists.data() );
+                        for (Index i=0; i<chunkSize; i++){
+                            if (state.chunkSquaredDists[i] < bestSquaredDist){
+                                bestSquaredDist = state.chunkSquaredDists[i];
+                                bestPointIndex = pointIndicesBucket[chunkStart + i];
+                            }
+                        }
+                    }
+                }
+                bound = std::max(bound, bestSquaredDist);
+                minSquaredDist = std::min(minSquaredDist, bestSquaredDist);
+            }
+            // every query point is within the box diagonal from the one with
+            // the closest neighbor, which gives another bound
+            float squaredDiagonal = 0;
+            for (Index dim=0; dim<3; dim++){
+                const float extent = queryBox[3 + dim] - queryBox[dim];
+                squaredDiagonal += extent * extent;
+            }
+            const float closeBound = std::sqrt(minSquaredDist) + std::sqrt(squaredDiagonal);
+            state.bounds[queryNodeIndex] = std::min(bound, closeBound * closeBound);
+            return;
+        } 
+        
+        const auto largest_extent = [](const float *box){
+            return std::max({box[3] - box[0], box[4] - box[1], box[5] - box[2]});
+        };
+
+        if (targetNode.is_leaf() || (!queryNode.is_leaf() && 
+                    largest_extent(queryBox) >= largest_extent(targetBox))){
+            // split the query node
+            const Index leftNodeIndex = queryNodeIndex + 1;
+            const Index rightNodeIndex = queryNode.get_right_child_node_index();
+            dual_tree_search( queryTree, leftNodeIndex, targetNodeIndex, state );
+            dual_tree_search( queryTree, rightNodeIndex, targetNodeIndex, state );
+            state.bounds[queryNodeIndex] = std::max( state.bounds[leftNodeIndex], 
+                                                     state.bounds[rightNodeIndex] );
         } else {
-            // this is a split node
-            auto cutValue = node.get_cut_value();
-            auto dim = node.get_dim();
-            const Index leftChildNodeIndex = nodeIndex + 1;
-            const Index rightChildNodeIndex = node.get_right_child_node_index();
-            if (queryPoint(dim) < cutValue){
-                // left child node is closer
-                knn_update_heap(queryPoint, indexHeap, leftChildNodeIndex);
-                knn_update_heap(queryPoint, indexHeap, rightChildNodeIndex);
-            } else {
-                // right child node is closer
-                knn_update_heap(queryPoint, indexHeap, rightChildNodeIndex);
-                knn_update_heap(queryPoint, indexHeap, leftChildNodeIndex);
+            // split the target node, and visit the closer child first
+            Index nearNodeIndex = targetNodeIndex + 1;
+            Index farNodeIndex = targetNode.get_right_child_node_index();
+            if (box_squared_distance(queryBox, state.targetBoxes.data() + 6*nearNodeIndex) > 
+                    box_squared_distance(queryBox, state.targetBoxes.data() + 6*farNodeIndex)){
+                std::swap(nearNodeIndex, farNodeIndex);
             }
+            dual_tree_search( queryTree, queryNodeIndex, nearNodeIndex, state );
+            dual_tree_search( queryTree, queryNodeIndex, farNodeIndex, state );
         }
     }
 
-    auto build_kd_tree(const Points &points){
-        auto pointNum = points.shape(0);
-        pointIndicesBucket.reserve( pointNum );
-        Points::shape_type sh = {pointNum, 3};
-        pointsBucket = xt::empty<float>( sh );
-        // std::cout<< "\nreserve node number: " << pointNum/leafSize*2 <<std::endl;
-        kdTreeNodes.reserve( pointNum / leafSize * 2 );
-        
-        PointIndices pointIndices = xt::arange<Index>(0, pointNum);
-        build_kd_nodes(points, pointIndices);
-        assert(pointIndicesBucket.size() == pointNum);
-        kdTreeNodes.shrink_to_fit();
+    auto build_kd_tree(const Points &points, const std::size_t &threadNum){
+        const Index pointNum_ = points.shape(0);
+        auto buffers = std::make_shared<KDTreeBuffers>();
+        buffers->pointIndices.resize( pointNum_ );
+        std::iota( buffers->pointIndices.begin(), buffers->pointIndices.end(), 0 );
+        buffers->points.resize( 3 * pointNum_ );
+        buffers->nodes.resize( count_nodes(pointNum_) );
+
+        // every level doubles the number of tasks 
+        const Index parallelDepth = std::ceil( std::log2( utils::get_thread_num(threadNum) ) );
+        build_kd_nodes( *buffers, points, 0, pointNum_, 0, boundingBox, parallelDepth );
+        set_buffers( buffers );
     }
 
 public:
+    /*
+     * \param pointsBucket_: the points in bucket order (N x 3)
+     */
     KDTree(const KDTreeNodes &kdTreeNodes_, 
-            const PointIndicesBucket &pointIndicesBucket_, const PyPoints &pointsBucket_, 
+            const PointIndicesBucket &pointIndicesBucket_, const Points &pointsBucket_, 
             const Index &leafSize_): 
-                kdTreeNodes(kdTreeNodes_), pointIndicesBucket(pointIndicesBucket_),
-                pointsBucket(Points(pointsBucket_)), leafSize(leafSize_){}
+                leafSize(leafSize_), boundingBox(pointsBucket_){
+        auto buffers = std::make_shared<KDTreeBuffers>();
+        buffers->nodes = kdTreeNodes_;
+        buffers->pointIndices = pointIndicesBucket_;
+        const Points points = xt::transpose( pointsBucket_ );
+        buffers->points.assign( points.begin(), points.end() );
+        set_buffers( buffers );
+    }
 
-    KDTree( const std::tuple<KDTreeNodes, PointIndicesBucket, PyPoint, Index> &tp ):
-        kdTreeNodes(std::get<0>(tp)), pointIndicesBucket(std::get<1>(tp)), 
-        pointsBucket( Points( std::get<2>(tp) ) ), leafSize(std::get<3>(tp)){}
+    KDTree( const std::tuple<KDTreeNodes, PointIndicesBucket, PyPoints, Index> &tp ):
+        KDTree( std::get<0>(tp), std::get<1>(tp), Points(std::get<2>(tp)), std::get<3>(tp) ){}
 
-    KDTree( const Points &points, const std::size_t &leafSize_ ): 
-                leafSize(leafSize_), 
-                kdTreeNodes({}), pointIndicesBucket({}){
-        build_kd_tree( points );
+    /*
+     * \param threadNum: the number of threads to build the subtrees, 
+     *      0 means all the hardware threads.
+     */
+    KDTree( const Points &points, const std::size_t &leafSize_, 
+                                    const std::size_t &threadNum = 0 ): 
+                leafSize(leafSize_), boundingBox(points){
+        build_kd_tree( points, threadNum );
     }
 
-    KDTree( const PyPoints &points, const std::size_t &leafSize_ ):
-                leafSize(leafSize_), kdTreeNodes({}), pointIndicesBucket({}){
-        build_kd_tree( Points( points) );
+    KDTree( const PyPoints &points, const std::size_t &leafSize_, 
+                                    const std::size_t &threadNum = 0 ):
+                KDTree( Points(points), leafSize_, threadNum ){
     }
 
+    /*
+     * use a tree in the binary format without copy.
+     * \param data: the start of the tree header, should be aligned to 8 bytes.
+     * \param size: the available bytes from data
+     * \param owner: keeps the memory alive, such as a memory mapped file.
+     */
+    KDTree( const char *data, const std::size_t &size, 
+                                    const std::shared_ptr<const void> &owner ):
+        KDTree( check_header(data, size), data, owner ){}
+
+    /*
+     * memory map a tree saved by save(), the tree is read only.
+     */
+    KDTree( const std::shared_ptr<const utils::MappedFile> &file, 
+                                                const std::size_t &offset = 0 ):
+        KDTree( file->data() + check_offset(offset, file->get_size()), 
+                file->get_size() - offset, file ){}
+
+    KDTree( const std::string &fileName ):
+        KDTree( std::shared_ptr<const utils::MappedFile>(
+                    std::make_shared<utils::MappedFile>(fileName)) ){}
+
     auto get_kd_tree_nodes() const {
-        return kdTreeNodes;
+        return KDTreeNodes( kdTreeNodes, kdTreeNodes + nodeNum );
     }
 
     auto get_point_indices_bucket() const {
-        return pointIndicesBucket;
+        return PointIndicesBucket( pointIndicesBucket, pointIndicesBucket + pointNum );
     }
 
+    // the points in bucket order (N x 3)
     auto get_py_points_bucket() const {
-        return PyPoints(pointsBucket);
+        Points::shape_type sh = {pointNum, 3};
+        Points points = xt::empty<float>(sh);
+        for (Index i=0; i<pointNum; i++){
+            points(i, 0) = pointsBucket[i];
+            points(i, 1) = pointsBucket[pointNum + i];
+            points(i, 2) = pointsBucket[2*pointNum + i];
+        }
+        return PyPoints( points );
     }
 
     auto get_leaf_size() const {
         return leafSize;
     }
 
+    auto get_point_num() const {
+        return pointNum;
+    }
+
+    inline const auto& get_bounding_box() const {
+        return boundingBox;
+    }
+
+    /*
+     * the header of binary format.
+     */
+    auto get_binary_header() const {
+        KDTreeHeader header;
+        std::memset(&header, 0, sizeof(KDTreeHeader));
+        std::memcpy(header.magic, KD_TREE_MAGIC, sizeof(KD_TREE_MAGIC));
+        header.version = KD_TREE_FORMAT_VERSION;
+        header.leafSize = leafSize;
+        header.pointNum = pointNum;
+        header.nodeNum = nodeNum;
+        std::copy(boundingBox.data(), boundingBox.data() + 6, header.boundingBox);
+        header.nodesOffset = utils::align_offset( sizeof(KDTreeHeader) );
+        header.pointIndicesOffset = utils::align_offset( 
+                                header.nodesOffset + nodeNum * sizeof(KDTreeNode) );
+        header.pointsOffset = utils::align_offset( 
+                                header.pointIndicesOffset + pointNum * sizeof(Index) );
+        header.size = utils::align_offset( 
+                                header.pointsOffset + 3 * pointNum * sizeof(float) );
+        return header;
+    }
+
+    /*
+     * write the tree in binary format.
+     * the stream position should be aligned to utils::BINARY_ALIGNMENT 
+     * for the tree to be memory mapped.
+     * \return the number of bytes written.
+     */
+    std::size_t write(std::ostream &out) const {
+        const auto header = get_binary_header();
+        const std::vector<char> padding(utils::BINARY_ALIGNMENT, 0);
+        auto write_section = [&](const void *data, const std::size_t &start, 
+                                    const std::size_t &bytes, const std::size_t &stop){
+            out.write(static_cast<const char*>(data), bytes);
+            out.write(padding.data(), stop - start - bytes);
+        };
+        write_section(&header, 0, sizeof(KDTreeHeader), header.nodesOffset);
+        write_section(kdTreeNodes, header.nodesOffset, nodeNum * sizeof(KDTreeNode), 
+                                                        header.pointIndicesOffset);
+        write_section(pointIndicesBucket, header.pointIndicesOffset, 
+                                    pointNum * sizeof(Index), header.pointsOffset);
+        write_section(pointsBucket, header.pointsOffset, 
+                                    3 * pointNum * sizeof(float), header.size);
+        return header.size;
+    }
+
+    void save(const std::string &fileName) const {
+        std::ofstream out(fileName, std::ios::out | std::ios::binary);
+        if (!out.is_open()){
+            throw std::runtime_error("can not open file: " + fileName);
+        }
+        write(out);
+    }
+
+    /*
+     * the tree in binary format, such as the state of pickle.
+     */
+    std::string to_bytes() const {
+        std::ostringstream out(std::ios::out | std::ios::binary);
+        write(out);
+        return out.str();
+    }
+
+    /*
+     * copy the bytes of to_bytes() into an aligned buffer owned by the tree.
+     */
+    static KDTree from_bytes(const std::string &bytes){
+        auto buffer = std::make_shared<std::vector<std::uint64_t>>( 
+                                    (bytes.size() + sizeof(std::uint64_t) - 1) / 
+                                                            sizeof(std::uint64_t) );
+        std::memcpy(buffer->data(), bytes.data(), bytes.size());
+        return KDTree( reinterpret_cast<const char*>(buffer->data()), bytes.size(), buffer );
+    }
+
+    /*
+     * find the nearest neighbor in this tree for every point of another tree.
+     * the two trees are walked together and the pairs of far apart nodes 
+     * are pruned, so the nearby query points share the tree walk.
+     * \return the nearest point indices and squared distances, 
+     *      in the original order of query points.
+     */
+    auto dual_tree_nearest_neighbors(const KDTree &queryTree) const {
+        DualTreeState state( queryTree, *this );
+        dual_tree_search( queryTree, 0, 0, state );
+
+        PointIndices::shape_type sh = {queryTree.pointNum};
+        PointIndices nearestPointIndices = xt::empty<Index>(sh);
+        xt::xtensor<float, 1> squaredDists = xt::empty<float>(sh);
+        for (Index queryBucketIndex = 0; queryBucketIndex<queryTree.pointNum; queryBucketIndex++){
+            const Index queryPointIndex = queryTree.pointIndicesBucket[queryBucketIndex];
+            nearestPointIndices( queryPointIndex ) = state.pointIndices[ queryBucketIndex ];
+            squaredDists( queryPointIndex ) = state.squaredDists[ queryBucketIndex ];
+        }
+        return std::make_tuple( nearestPointIndices, squaredDists );
+    }
+
     auto get_serializable_tuple() const {
-        return std::make_tuple( kdTreeNodes, pointIndicesBucket, 
+        return std::make_tuple( get_kd_tree_nodes(), get_point_indices_bucket(), 
                                 get_py_points_bucket(), leafSize);
     }
 
+    /*
+     * find the nearest neighbor.
+     * \return the point index and squared distance of the nearest neighbor
+     */
+    inline std::pair<Index, float> nearest_neighbor(const float *queryPoint) const {
+        NearestNeighbor nearestNeighbor;
+        update_neighbors( queryPoint, nearestNeighbor );
+        return std::make_pair( nearestNeighbor.get_point_index(), 
+                                nearestNeighbor.max_squared_dist() );
+    }
+
+    /*
+     * find the nearest neighbor starting from a known candidate, such as the
+     * nearest neighbor of the previous query point nearby.
+     * The candidate gives a tight bound from the beginning, so the cells
+     * farther than it are pruned without visiting the leaves.
+     * \param candidateSquaredDist: the squared distance from query point to the candidate
+     */
+    inline std::pair<Index, float> nearest_neighbor(const float *queryPoint,
+                const Index &candidatePointIndex, const float &candidateSquaredDist) const {
+        NearestNeighbor nearestNeighbor;
+        nearestNeighbor.update( candidateSquaredDist, candidatePointIndex );
+        update_neighbors( queryPoint, nearestNeighbor );
+        return std::make_pair( nearestNeighbor.get_point_index(),
+                                nearestNeighbor.max_squared_dist() );
+    }
+
+    /*
+     * find the approximate nearest neighbor.
+     * \param budget: the error and leaf number limit, the scanned leaf number
+     * will be written back.
+     */
+    inline std::pair<Index, float> nearest_neighbor(const float *queryPoint, 
+                                                        SearchBudget &budget) const {
+        NearestNeighbor nearestNeighbor;
+        update_neighbors( queryPoint, nearestNeighbor, budget );
+        return std::make_pair( nearestNeighbor.get_point_index(), 
+                                nearestNeighbor.max_squared_dist() );
+    }
+
+    /*
+     * find the approximate nearest k neighbors.
+     * the distance of the i-th neighbor found is at most (1+epsilon) times 
+     * of the true i-th neighbor if the leaf number limit is not reached.
+     * \param epsilon: the relative distance error bound
+     * \param maxLeafNum: stop after scanning this number of leaves
+     * \return the point indices and the number of scanned leaves
+     */
+    template<class Neighbors>
+    inline auto knn_approximate(const Point &queryPoint, const Index &K, 
+                const float &epsilon, const Index &maxLeafNum) const {
+        Neighbors neighbors(K);
+        SearchBudget budget(epsilon, maxLeafNum);
+        update_neighbors( queryPoint.data(), neighbors, budget );
+        return std::make_tuple( PointIndices(neighbors.get_point_indices()), budget.leafNum );
+    }
+
+    inline std::tuple<PointIndices, Index> knn_approximate(const Point &queryPoint, 
+                const Index &K, const float &epsilon = 0, 
+                const Index &maxLeafNum = std::numeric_limits<Index>::max()) const {
+        if (K == 1){
+            return knn_approximate<NearestNeighbor>(queryPoint, K, epsilon, maxLeafNum);
+        } else if (K <= SMALL_K){
+            return knn_approximate<SortedNeighbors<SMALL_K>>(queryPoint, K, 
+                                                            epsilon, maxLeafNum);
+        } else {
+            return knn_approximate<IndexHeap>(queryPoint, K, epsilon, maxLeafNum);
+        }
+    }
+
+    inline auto py_knn_approximate(const PyPoint &queryPoint, const Index &K, 
+                        const float &epsilon, const Index &maxLeafNum) const {
+        return knn_approximate(queryPoint, K, epsilon, maxLeafNum);
+    }
+
     /*
      * find the nearest k neighbors
      */
+    template<class Neighbors>
     inline auto knn(const Point &queryPoint, const Index &K) const {
-        // build priority queue to store the nearest neighbors
-        IndexHeap indexHeap(K);
-        
-        // the first one is the root node
-        knn_update_heap( queryPoint, indexHeap, 0 );
-        
-        return indexHeap.get_point_indices();
+        Neighbors neighbors(K);
+        update_neighbors( queryPoint.data(), neighbors );
+        return neighbors.get_point_indices();
+    }
+
+    inline PointIndices knn(const Point &queryPoint, const Index &K) const {
+        // use specialized result buffers for small K
+        if (K == 1){
+            return knn<NearestNeighbor>(queryPoint, K);
+        } else if (K <= SMALL_K){
+            return knn<SortedNeighbors<SMALL_K>>(queryPoint, K);
+        } else {
+            return knn<IndexHeap>(queryPoint, K);
+        }
     }
 
     inline auto py_knn(const PyPoint &queryPoint, const int &K) const {
         return knn(queryPoint, K);
     }
+
+    template<class Neighbors>
+    void knn_batch(const Points &queryPoints, const Index &K,
+                    xt::xtensor<Index, 2> &pointIndices, xt::xtensor<float, 2> &squaredDists,
+                    const std::size_t &threadNum) const {
+        const Index queryNum = queryPoints.shape(0);
+        // each query only writes its own row, so no lock is needed.
+        utils::parallel_for(queryNum, [&](const std::size_t &queryIdx){
+            const float queryPoint[3] = {queryPoints(queryIdx, 0), 
+                                         queryPoints(queryIdx, 1), 
+                                         queryPoints(queryIdx, 2)};
+            Neighbors neighbors(K);
+            update_neighbors( queryPoint, neighbors );
+            neighbors.pop_to( pointIndices, squaredDists, queryIdx );
+        }, threadNum, KNN_BATCH_GRAIN_SIZE);
+    }
+
+    /*
+     * find the nearest k neighbors for a batch of query points in parallel.
+     * only the first 3 columns of queryPoints are used, so a N x 4 array 
+     * with radius is also accepted.
+     * each row of the returned arrays is a query point, the columns are
+     * ordered the same as knn.
+     * \param threadNum: the number of threads, 0 means all the hardware threads.
+     */
+    auto knn_batch_with_squared_distances(const Points &queryPoints, const Index &K,
+                                            const std::size_t &threadNum = 0) const {
+        assert( queryPoints.shape(1) >= 3 );
+        const Index queryNum = queryPoints.shape(0);
+        xt::xtensor<Index, 2>::shape_type sh = {queryNum, K};
+        xt::xtensor<Index, 2> pointIndices = xt::empty<Index>(sh);
+        xt::xtensor<float, 2> squaredDists = xt::empty<float>(sh);
+
+        if (K == 1){
+            knn_batch<NearestNeighbor>(queryPoints, K, pointIndices, squaredDists, threadNum);
+        } else if (K <= SMALL_K){
+            knn_batch<SortedNeighbors<SMALL_K>>(queryPoints, K, pointIndices, 
+                                                            squaredDists, threadNum);
+        } else {
+            knn_batch<IndexHeap>(queryPoints, K, pointIndices, squaredDists, threadNum);
+        }
+        return std::make_tuple(pointIndices, squaredDists);
+    }
+
+    inline auto knn_batch(const Points &queryPoints, const Index &K, 
+                                            const std::size_t &threadNum = 0) const {
+        return std::get<0>( knn_batch_with_squared_distances(queryPoints, K, threadNum) );
+    }
+
+    /*
+     * find all the points within a radius, including the points on the sphere.
+     * the point indices are in bucket order rather than sorted by distance.
+     * \return the point indices and their squared distances
+     */
+    inline auto radius_search_with_squared_distances(const Point &queryPoint, 
+                                                    const float &radius) const {
+        RadiusNeighbors neighbors(radius);
+        update_neighbors( queryPoint.data(), neighbors );
+        return std::make_tuple( neighbors.get_point_indices(), neighbors.get_squared_dists() );
+    }
+
+    inline auto radius_search(const Point &queryPoint, const float &radius) const {
+        return std::get<0>( radius_search_with_squared_distances(queryPoint, radius) );
+    }
+
+    inline auto py_radius_search(const PyPoint &queryPoint, const float &radius) const {
+        return radius_search(queryPoint, radius);
+    }
+
+    inline auto py_radius_search_with_squared_distances(const PyPoint &queryPoint, 
+                                                        const float &radius) const {
+        return radius_search_with_squared_distances(queryPoint, radius);
+    }
+
+    /*
+     * count the points within a radius for a batch of query points in parallel.
+     * only the first 3 columns of queryPoints are used.
+     */
+    auto radius_count(const Points &queryPoints, const float &radius, 
+                                            const std::size_t &threadNum = 0) const {
+        assert( queryPoints.shape(1) >= 3 );
+        const Index queryNum = queryPoints.shape(0);
+        PointIndices::shape_type sh = {queryNum};
+        PointIndices counts = xt::empty<Index>(sh);
+        
+        utils::parallel_for(queryNum, [&](const std::size_t &queryIdx){
+            const float queryPoint[3] = {queryPoints(queryIdx, 0), 
+                                         queryPoints(queryIdx, 1), 
+                                         queryPoints(queryIdx, 2)};
+            RadiusCounter counter(radius);
+            update_neighbors( queryPoint, counter );
+            counts(queryIdx) = counter.size();
+        }, threadNum, KNN_BATCH_GRAIN_SIZE);
+        return counts;
+    }
+
+    inline auto py_radius_count(const PyPoints &queryPoints, const float &radius,
+                                            const std::size_t &threadNum) const {
+        const Points points = queryPoints;
+        py::gil_scoped_release release;
+        return radius_count(points, radius, threadNum);
+    }
+
+    inline auto py_knn_batch(const PyPoints &queryPoints, const Index &K, 
+                                            const std::size_t &threadNum) const {
+        const Points points = queryPoints;
+        // the search do not touch any python object
+        py::gil_scoped_release release;
+        return knn_batch(points, K, threadNum);
+    }
+
+    inline auto py_knn_batch_with_squared_distances(const PyPoints &queryPoints, 
+                            const Index &K, const std::size_t &threadNum) const {
+        const Points points = queryPoints;
+        py::gil_scoped_release release;
+        return knn_batch_with_squared_distances(points, K, threadNum);
+    }
 }; //end of KDTree class
 
 } // end of namespace
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
 #include "xtensor-blas/xlinalg.hpp"
 #include "xtensor/xfixed.hpp"
 #include "xtensor/xsort.hpp"
@@ -35,4 +38,130 @@ inline auto py_pca_first_component(xt::pytensor<float, 2> pysample){
     return pca_first_component( sample );
 }
 
+/**
+ * \brief the eigenvector of the largest eigenvalue of a symmetric 3x3 matrix.
+ * The eigenvalue is solved in closed form with the trigonometric solution of 
+ * the characteristic cubic, and the eigenvector is the largest cross product 
+ * of two rows of (A - eigenvalue * I), so there is no iteration and no heap allocation.
+ * https://en.wikipedia.org/wiki/Eigenvalue_algorithm#3%C3%973_matrices
+ * \param matrix: the upper triangle of matrix, xx, xy, xz, yy, yz, zz
+ * \param eigenvector: output, the unit eigenvector
+ */
+inline void principal_eigenvector_3x3(const double *matrix, float *eigenvector){
+    const double a00 = matrix[0], a01 = matrix[1], a02 = matrix[2];
+    const double a11 = matrix[3], a12 = matrix[4], a22 = matrix[5];
+
+    const double offDiagonal = a01*a01 + a02*a02 + a12*a12;
+    const double q = (a00 + a11 + a22) / 3.;
+    const double p2 = (a00-q)*(a00-q) + (a11-q)*(a11-q) + (a22-q)*(a22-q) + 2.*offDiagonal;
+    if (p2 <= 0.){
+        // the matrix is a multiple of identity, every direction is an eigenvector
+        eigenvector[0] = 1.f; eigenvector[1] = 0.f; eigenvector[2] = 0.f;
+        return;
+    }
+
+    double eigenvalue;
+    if (offDiagonal == 0.){
+        eigenvalue = std::max({a00, a11, a22});
+    } else {
+        const double p = std::sqrt(p2 / 6.);
+        // B = (A - qI) / p
+        const double b00 = (a00-q)/p, b11 = (a11-q)/p, b22 = (a22-q)/p;
+        const double b01 = a01/p, b02 = a02/p, b12 = a12/p;
+        const double halfDeterminant = 0.5 * ( b00*(b11*b22 - b12*b12) - 
+                                b01*(b01*b22 - b12*b02) + b02*(b01*b12 - b11*b02) );
+        const double phi = std::acos( std::clamp(halfDeterminant, -1., 1.) ) / 3.;
+        eigenvalue = q + 2. * p * std::cos(phi);
+    }
+
+    // the rows of A - eigenvalue * I are orthogonal to the eigenvector
+    const double rows[3][3] = {
+        {a00 - eigenvalue, a01, a02}, 
+        {a01, a11 - eigenvalue, a12}, 
+        {a02, a12, a22 - eigenvalue}};
+    const auto cross = [](const double *u, const double *v, double *w){
+        w[0] = u[1]*v[2] - u[2]*v[1];
+        w[1] = u[2]*v[0] - u[0]*v[2];
+        w[2] = u[0]*v[1] - u[1]*v[0];
+        return w[0]*w[0] + w[1]*w[1] + w[2]*w[2];
+    };
+    double candidates[3][3];
+    const double norms[3] = {
+        cross(rows[0], rows[1], candidates[0]), 
+        cross(rows[0], rows[2], candidates[1]), 
+        cross(rows[1], rows[2], candidates[2])};
+    const std::size_t best = std::max_element(norms, norms + 3) - norms;
+
+    double squaredRowNorms[3];
+    for (std::size_t i=0; i<3; i++){
+        squaredRowNorms[i] = rows[i][0]*rows[i][0] + rows[i][1]*rows[i][1] + rows[i][2]*rows[i][2];
+    }
+    const std::size_t longestRow = std::max_element(squaredRowNorms, squaredRowNorms + 3) - squaredRowNorms;
+    const double scale = squaredRowNorms[longestRow];
+
+    double vector[3];
+    if (norms[best] > 1e-12 * scale * scale){
+        std::copy(candidates[best], candidates[best] + 3, vector);
+    } else {
+        // the largest eigenvalue is repeated, and the rows are parallel. 
+        // any direction orthogonal to the rows is an eigenvector.
+        const double *row = rows[longestRow];
+        const std::size_t axis = std::min_element(row, row + 3, 
+                    [](const double &a, const double &b){return std::abs(a) < std::abs(b);}) - row;
+        double unit[3] = {0., 0., 0.};
+        unit[axis] = 1.;
+        cross(row, unit, vector);
+    }
+
+    const double norm = std::sqrt(vector[0]*vector[0] + vector[1]*vector[1] + vector[2]*vector[2]);
+    for (std::size_t i=0; i<3; i++){
+        eigenvector[i] = vector[i] / norm;
+    }
+}
+
+/**
+ * \brief encode a unit vector to two signed integers with octahedral mapping.
+ * The vector is projected to the octahedron |x|+|y|+|z|=1, and the lower 
+ * half is folded onto the upper half, so the two coordinates cover the sphere 
+ * uniformly.
+ * Cigolle, Zina H., et al. "A survey of efficient representations for 
+ * independent unit vectors." Journal of Computer Graphics Techniques 3.2 (2014).
+ */
+template<class Int>
+inline void octahedral_encode(const float *vector, Int *code){
+    const float scale = std::numeric_limits<Int>::max();
+    const float norm1 = std::abs(vector[0]) + std::abs(vector[1]) + std::abs(vector[2]);
+    float x = vector[0] / norm1;
+    float y = vector[1] / norm1;
+    if (vector[2] < 0.f){
+        const float foldedX = (1.f - std::abs(y)) * std::copysign(1.f, x);
+        const float foldedY = (1.f - std::abs(x)) * std::copysign(1.f, y);
+        x = foldedX;
+        y = foldedY;
+    }
+    code[0] = static_cast<Int>( std::lround(x * scale) );
+    code[1] = static_cast<Int>( std::lround(y * scale) );
+}
+
+/**
+ * \brief decode the octahedral encoding to a unit vector.
+ */
+template<class Int>
+inline void octahedral_decode(const Int *code, float *vector){
+    const float scale = std::numeric_limits<Int>::max();
+    float x = code[0] / scale;
+    float y = code[1] / scale;
+    const float z = 1.f - std::abs(x) - std::abs(y);
+    if (z < 0.f){
+        const float unfoldedX = (1.f - std::abs(y)) * std::copysign(1.f, x);
+        const float unfoldedY = (1.f - std::abs(x)) * std::copysign(1.f, y);
+        x = unfoldedX;
+        y = unfoldedY;
+    }
+    const float norm = std::sqrt(x*x + y*y + z*z);
+    vector[0] = x / norm;
+    vector[1] = y / norm;
+    vector[2] = z / norm;
+}
+
 } // namespace reneu::utils
\ No newline at end of file
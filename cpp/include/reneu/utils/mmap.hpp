@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+namespace reneu::utils{
+
+// the sections of our binary formats are aligned to cache lines
+const std::size_t BINARY_ALIGNMENT = 64;
+
+inline std::size_t align_offset( const std::size_t &offset,
+                                    const std::size_t &alignment = BINARY_ALIGNMENT ){
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+/**
+ * \brief check that a section of count elements of type T starting at offset
+ * is aligned for T and inside size bytes, without overflow.
+ */
+template<class T>
+inline bool is_valid_section( const std::uint64_t &offset, const std::uint64_t &count,
+                                                        const std::uint64_t &size ){
+    return offset % alignof(T) == 0 && offset <= size && 
+                count <= (size - offset) / sizeof(T);
+}
+
+/**
+ * \brief a memory mapped file.
+ * The file is unmapped when this object is destroyed, so share it
+ * with a smart pointer to keep the views of its memory valid.
+ */
+class MappedFile{
+private:
+    int fileDescriptor;
+    char *address;
+    std::size_t size;
+    bool writable;
+
+    void map(const std::string &fileName){
+        const int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        void *ret = mmap(nullptr, size, protection, MAP_SHARED, fileDescriptor, 0);
+        if (ret == MAP_FAILED){
+            close(fileDescriptor);
+            throw std::runtime_error("can not memory map file: " + fileName +
+                                        ", " + std::strerror(errno));
+        }
+        address = static_cast<char*>(ret);
+    }
+
+public:
+    /**
+     * \brief map an existing file read only
+     */
+    MappedFile(const std::string &fileName): writable(false){
+        fileDescriptor = open(fileName.c_str(), O_RDONLY);
+        if (fileDescriptor < 0){
+            throw std::runtime_error("can not open file: " + fileName);
+        }
+        struct stat fileStatus;
+        if (fstat(fileDescriptor, &fileStatus) < 0 || fileStatus.st_size == 0){
+            close(fileDescriptor);
+            throw std::runtime_error("can not map empty file: " + fileName);
+        }
+        size = fileStatus.st_size;
+        map(fileName);
+    }
+
+    /**
+     * \brief create a file with the given size and map it writable.
+     * an existing file will be truncated.
+     */
+    MappedFile(const std::string &fileName, const std::size_t &size_):
+                                                    size(size_), writable(true){
+        if (size == 0){
+            throw std::runtime_error("can not map empty file: " + fileName);
+        }
+        fileDescriptor = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fileDescriptor < 0){
+            throw std::runtime_error("can not create file: " + fileName);
+        }
+        if (ftruncate(fileDescriptor, size) < 0){
+            close(fileDescriptor);
+            throw std::runtime_error("can not resize file: " + fileName);
+        }
+        map(fileName);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile(){
+        munmap(address, size);
+        close(fileDescriptor);
+    }
+
+    inline const char* data() const {
+        return address;
+    }
+
+    inline char* mutable_data() {
+        if (!writable){
+            throw std::runtime_error("the memory mapped file is read only.");
+        }
+        return address;
+    }
+
+    inline auto get_size() const {
+        return size;
+    }
+
+    /**
+     * \brief write the modified pages back to disk
+     */
+    void flush() {
+        if (writable){
+            msync(address, size, MS_SYNC);
+        }
+    }
+}; // end of class MappedFile
+
+} // namespace reneu::utils
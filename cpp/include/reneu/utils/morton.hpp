@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "reneu/type_aliase.hpp"
+
+
+namespace reneu::utils{
+
+// the number of bits of each axis in a 64 bits Morton code
+const std::uint32_t MORTON_BITS_PER_AXIS = 21;
+
+/**
+ * \brief insert two zero bits after every bit of the lower 21 bits.
+ */
+inline std::uint64_t spread_morton_bits(std::uint64_t x){
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+/**
+ * \brief interleave the bits of three 21 bits coordinates to a Z-order curve code.
+ */
+inline std::uint64_t morton_code(const std::uint32_t &x, const std::uint32_t &y,
+                                                        const std::uint32_t &z){
+    return spread_morton_bits(x) | (spread_morton_bits(y) << 1) |
+                                    (spread_morton_bits(z) << 2);
+}
+
+/**
+ * \brief the order of points along the Morton (Z-order) curve in their bounding box.
+ * The points close in the order are also close in space.
+ * Only the first 3 columns are used, so a N x 4 array with radius is also accepted.
+ * \return the original point index of each position in the order
+ */
+inline std::vector<Index> morton_order(const Points &points){
+    const Index pointNum = points.shape(0);
+    std::vector<Index> order( pointNum );
+    if (pointNum == 0){
+        return order;
+    }
+
+    float minCorner[3], maxCorner[3];
+    for (Index dim=0; dim<3; dim++){
+        minCorner[dim] = points(0, dim);
+        maxCorner[dim] = points(0, dim);
+    }
+    for (Index pointIdx=1; pointIdx<pointNum; pointIdx++){
+        for (Index dim=0; dim<3; dim++){
+            minCorner[dim] = std::min(minCorner[dim], points(pointIdx, dim));
+            maxCorner[dim] = std::max(maxCorner[dim], points(pointIdx, dim));
+        }
+    }
+    // use the same scale for all the axes to keep the cells cubic
+    const float extent = std::max({maxCorner[0] - minCorner[0],
+                                   maxCorner[1] - minCorner[1],
+                                   maxCorner[2] - minCorner[2]});
+    const double maxCoordinate = (1u << MORTON_BITS_PER_AXIS) - 1;
+    const double scale = extent > 0.f ? maxCoordinate / extent : 0.;
+
+    std::vector<std::pair<std::uint64_t, Index>> codes( pointNum );
+    for (Index pointIdx=0; pointIdx<pointNum; pointIdx++){
+        std::uint32_t coordinates[3];
+        for (Index dim=0; dim<3; dim++){
+            coordinates[dim] = static_cast<std::uint32_t>( std::min( maxCoordinate,
+                            (points(pointIdx, dim) - minCorner[dim]) * scale ) );
+        }
+        codes[pointIdx] = std::make_pair(
+                morton_code(coordinates[0], coordinates[1], coordinates[2]), pointIdx );
+    }
+    // the ties are broken by the original index, so the order is deterministic
+    std::sort(codes.begin(), codes.end());
+    for (Index i=0; i<pointNum; i++){
+        order[i] = codes[i].second;
+    }
+    return order;
+}
+
+} // namespace reneu::utils
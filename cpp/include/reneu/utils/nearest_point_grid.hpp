@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "reneu/type_aliase.hpp"
+#include "reneu/utils/kd_tree.hpp"
+#include "reneu/utils/parallel.hpp"
+
+
+namespace reneu{
+
+// the number of cells of a block along each axis
+const Index GRID_BLOCK_WIDTH = 8;
+const Index GRID_BLOCK_CELL_NUM = GRID_BLOCK_WIDTH * GRID_BLOCK_WIDTH * GRID_BLOCK_WIDTH;
+// the mark of cells too far from any point
+const Index GRID_EMPTY_CELL = std::numeric_limits<Index>::max();
+
+/*
+ * the nearest point of every cell around a point set, precomputed in a sparse block grid.
+ * Only the blocks with some cells closer than the max distance are stored,
+ * so the memory grows with the volume around the points rather than their bounding box.
+ * A lookup is a hash of the block and an array access, no tree walk.
+ * The nearest point of cell center is returned for all the points inside the cell,
+ * so its distance is at most one cell diagonal longer than the true nearest neighbor.
+ * The cells are complete within the max distance, a query point farther than that
+ * from all the points could fall in an empty cell.
+ */
+class NearestPointGrid{
+private:
+    float resolution;
+    float maxDistance;
+    // the min corner of the grid
+    std::array<float, 3> origin;
+    // the number of blocks along each axis
+    std::array<std::int64_t, 3> blockNums;
+    std::unordered_map<std::uint64_t, Index> blockIndices;
+    // GRID_BLOCK_CELL_NUM point indices of each block
+    std::vector<Index> cells;
+
+    inline std::uint64_t block_key(const std::int64_t *block) const {
+        return (block[2] * blockNums[1] + block[1]) * blockNums[0] + block[0];
+    }
+
+    /*
+     * \return the nearest point index of the cells in a block, empty if all the cells are empty
+     */
+    std::vector<Index> compute_block_cells(const std::int64_t *block, const KDTree &kdTree,
+                                                        const float *points) const {
+        const float cellRadius = resolution * std::sqrt(3.f) / 2.f;
+        const float blockRadius = cellRadius * GRID_BLOCK_WIDTH;
+        const float maxCellDistance = maxDistance + cellRadius;
+
+        // skip the block if it is far from all the points
+        float blockCenter[3];
+        for (Index dim=0; dim<3; dim++){
+            blockCenter[dim] = origin[dim] + resolution * GRID_BLOCK_WIDTH * (block[dim] + 0.5f);
+        }
+        const auto [blockNearestPointIndex, blockSquaredDist] =
+                                            kdTree.nearest_neighbor( blockCenter );
+        const float maxBlockDistance = maxCellDistance + blockRadius;
+        if (blockSquaredDist >= maxBlockDistance * maxBlockDistance){
+            return std::vector<Index>();
+        }
+
+        std::vector<Index> blockCells( GRID_BLOCK_CELL_NUM, GRID_EMPTY_CELL );
+        bool isEmpty = true;
+        // the neighboring cells share the nearest point mostly
+        Index candidatePointIndex = blockNearestPointIndex;
+        for (Index cellIdx=0; cellIdx<GRID_BLOCK_CELL_NUM; cellIdx++){
+            const Index cell[3] = {cellIdx % GRID_BLOCK_WIDTH,
+                                   cellIdx / GRID_BLOCK_WIDTH % GRID_BLOCK_WIDTH,
+                                   cellIdx / (GRID_BLOCK_WIDTH * GRID_BLOCK_WIDTH)};
+            float cellCenter[3];
+            float candidateSquaredDist = 0.f;
+            for (Index dim=0; dim<3; dim++){
+                cellCenter[dim] = origin[dim] + resolution * (
+                                        block[dim] * GRID_BLOCK_WIDTH + cell[dim] + 0.5f);
+                const float diff = cellCenter[dim] - points[ 3*candidatePointIndex + dim ];
+                candidateSquaredDist += diff * diff;
+            }
+            const auto [nearestPointIndex, squaredDist] = kdTree.nearest_neighbor(
+                            cellCenter, candidatePointIndex, candidateSquaredDist );
+            candidatePointIndex = nearestPointIndex;
+            // a query point in this cell could be closer than max distance to some point
+            if (squaredDist < maxCellDistance * maxCellDistance){
+                blockCells[ cellIdx ] = nearestPointIndex;
+                isEmpty = false;
+            }
+        }
+        if (isEmpty){
+            blockCells.clear();
+        }
+        return blockCells;
+    }
+
+public:
+    /*
+     * \param kdTree: the tree of points
+     * \param points: N x 3 in C order, the same order with the tree
+     * \param resolution_: the size of cells
+     * \param maxDistance_: the cells are complete within this distance to the points
+     * \param threadNum: the number of threads, 0 means all the hardware threads.
+     */
+    NearestPointGrid( const KDTree &kdTree, const float *points, const float &resolution_,
+                        const float &maxDistance_, const std::size_t &threadNum = 0 ):
+                            resolution(resolution_), maxDistance(maxDistance_){
+        if (resolution <= 0.f){
+            throw std::runtime_error("the resolution of grid should be positive.");
+        }
+        const Index pointNum = kdTree.get_point_num();
+        const float *boundingBox = kdTree.get_bounding_box().data();
+        const float blockSize = resolution * GRID_BLOCK_WIDTH;
+        for (Index dim=0; dim<3; dim++){
+            origin[dim] = boundingBox[dim] - maxDistance;
+            const float extent = boundingBox[3 + dim] + maxDistance - origin[dim];
+            blockNums[dim] = static_cast<std::int64_t>( std::floor(extent / blockSize) ) + 1;
+        }
+        if (blockNums[0] * blockNums[1] * blockNums[2] >= (std::int64_t(1) << 62)){
+            throw std::runtime_error("the resolution of grid is too fine for the points.");
+        }
+
+        // the blocks containing points
+        std::unordered_set<std::uint64_t> pointBlockKeys;
+        for (Index pointIdx=0; pointIdx<pointNum; pointIdx++){
+            std::int64_t block[3];
+            for (Index dim=0; dim<3; dim++){
+                block[dim] = static_cast<std::int64_t>(
+                        (points[ 3*pointIdx + dim ] - origin[dim]) / blockSize );
+            }
+            pointBlockKeys.insert( block_key(block) );
+        }
+
+        // dilate them by the max distance
+        const std::int64_t radius = static_cast<std::int64_t>(
+                                            std::ceil(maxDistance / blockSize) );
+        std::unordered_set<std::uint64_t> candidateBlockKeys;
+        for (const auto &key : pointBlockKeys){
+            const std::int64_t center[3] = {
+                static_cast<std::int64_t>(key % blockNums[0]),
+                static_cast<std::int64_t>(key / blockNums[0] % blockNums[1]),
+                static_cast<std::int64_t>(key / blockNums[0] / blockNums[1])};
+            std::int64_t block[3];
+            for (block[2] = std::max(center[2] - radius, std::int64_t(0));
+                    block[2] <= std::min(center[2] + radius, blockNums[2] - 1); block[2]++){
+                for (block[1] = std::max(center[1] - radius, std::int64_t(0));
+                        block[1] <= std::min(center[1] + radius, blockNums[1] - 1); block[1]++){
+                    for (block[0] = std::max(center[0] - radius, std::int64_t(0));
+                            block[0] <= std::min(center[0] + radius, blockNums[0] - 1); block[0]++){
+                        // the gap between blocks along each axis
+                        float squaredGap = 0.f;
+                        for (Index dim=0; dim<3; dim++){
+                            const float gap = std::max(std::int64_t(0),
+                                    std::abs(block[dim] - center[dim]) - 1) * blockSize;
+                            squaredGap += gap * gap;
+                        }
+                        if (squaredGap <= maxDistance * maxDistance){
+                            candidateBlockKeys.insert( block_key(block) );
+                        }
+                    }
+                }
+            }
+        }
+
+        const std::vector<std::uint64_t> candidates( candidateBlockKeys.begin(),
+                                                     candidateBlockKeys.end() );
+        std::vector<std::vector<Index>> candidateCells( candidates.size() );
+        utils::parallel_for( candidates.size(), [&](const std::size_t &candidateIdx){
+            const std::uint64_t key = candidates[ candidateIdx ];
+            const std::int64_t block[3] = {
+                static_cast<std::int64_t>(key % blockNums[0]),
+                static_cast<std::int64_t>(key / blockNums[0] % blockNums[1]),
+                static_cast<std::int64_t>(key / blockNums[0] / blockNums[1])};
+            candidateCells[ candidateIdx ] = compute_block_cells( block, kdTree, points );
+        }, threadNum, 16);
+
+        for (std::size_t candidateIdx=0; candidateIdx<candidates.size(); candidateIdx++){
+            const auto &blockCells = candidateCells[ candidateIdx ];
+            if (blockCells.empty()){
+                continue;
+            }
+            blockIndices[ candidates[ candidateIdx ] ] = cells.size() / GRID_BLOCK_CELL_NUM;
+            cells.insert( cells.end(), blockCells.begin(), blockCells.end() );
+        }
+    }
+
+    inline auto get_resolution() const {
+        return resolution;
+    }
+
+    inline auto get_max_distance() const {
+        return maxDistance;
+    }
+
+    inline auto get_block_num() const {
+        return blockIndices.size();
+    }
+
+    // the memory of cells, the hash table is not counted
+    inline std::size_t get_byte_num() const {
+        return cells.size() * sizeof(Index);
+    }
+
+    /*
+     * \return the nearest point index of the cell containing the point,
+     *      GRID_EMPTY_CELL if the point is farther than the max distance to all the points.
+     */
+    inline Index find(const float *point) const {
+        std::int64_t cell[3];
+        for (Index dim=0; dim<3; dim++){
+            const float coordinate = std::floor( (point[dim] - origin[dim]) / resolution );
+            if (coordinate < 0.f || coordinate >= blockNums[dim] * GRID_BLOCK_WIDTH){
+                return GRID_EMPTY_CELL;
+            }
+            cell[dim] = static_cast<std::int64_t>( coordinate );
+        }
+        const std::int64_t block[3] = {cell[0] / GRID_BLOCK_WIDTH,
+                                       cell[1] / GRID_BLOCK_WIDTH,
+                                       cell[2] / GRID_BLOCK_WIDTH};
+        const auto iter = blockIndices.find( block_key(block) );
+        if (iter == blockIndices.end()){
+            return GRID_EMPTY_CELL;
+        }
+        const std::int64_t cellIdx = ((cell[2] % GRID_BLOCK_WIDTH) * GRID_BLOCK_WIDTH +
+                        cell[1] % GRID_BLOCK_WIDTH) * GRID_BLOCK_WIDTH + cell[0] % GRID_BLOCK_WIDTH;
+        return cells[ iter->second * GRID_BLOCK_CELL_NUM + cellIdx ];
+    }
+}; // class NearestPointGrid
+
+} // end of namespace
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+
+#include "reneu/utils/mmap.hpp"
+
+
+namespace reneu::utils{
+
+/**
+ * \brief the header of a numpy .npy file of a C ordered 2D float32 array.
+ * The header is padded to the binary alignment, so the array in the file
+ * could be memory mapped from both c++ and `numpy.load(mmap_mode='r')`.
+ * https://numpy.org/doc/stable/reference/generated/numpy.lib.format.html
+ */
+inline std::string make_npy_header(const std::size_t &rowNum, const std::size_t &colNum){
+    std::string dict = "{'descr': '<f4', 'fortran_order': False, 'shape': (" +
+                        std::to_string(rowNum) + ", " + std::to_string(colNum) + "), }";
+    // magic string, version 1.0 and the length of dict in 2 bytes
+    const std::size_t prefixSize = 10;
+    // the dict is terminated by a newline
+    const std::size_t headerSize = align_offset(prefixSize + dict.size() + 1);
+    dict.append(headerSize - prefixSize - dict.size() - 1, ' ');
+    dict.push_back('\n');
+
+    std::string header("\x93NUMPY\x01\x00", 8);
+    header.push_back( static_cast<char>(dict.size() & 0xff) );
+    header.push_back( static_cast<char>(dict.size() >> 8) );
+    return header + dict;
+}
+
+} // namespace reneu::utils
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace reneu::utils{
+
+/**
+ * \brief the number of worker threads to use.
+ * \param threadNum: requested number of threads, 0 means all the hardware threads.
+ */
+inline std::size_t get_thread_num(const std::size_t &threadNum = 0){
+    if (threadNum > 0){
+        return threadNum;
+    }
+    const std::size_t hardwareThreadNum = std::thread::hardware_concurrency();
+    return std::max(hardwareThreadNum, std::size_t(1));
+}
+
+/**
+ * \brief run func(taskIdx) for every taskIdx in [0, taskNum) with a pool of threads.
+ * The tasks are handed out dynamically in chunks of grainSize,
+ * so unbalanced tasks will not stall the whole pool.
+ * The first exception thrown by any task is rethrown in the calling thread.
+ * \param taskNum: the number of tasks
+ * \param func: the task function taking the task index
+ * \param threadNum: the number of threads, 0 means all the hardware threads.
+ * \param grainSize: the number of consecutive tasks picked up by a thread at once.
+ */
+template<class Func>
+void parallel_for(const std::size_t &taskNum, Func &&func,
+                    const std::size_t &threadNum = 0, const std::size_t &grainSize = 1){
+    const std::size_t grain = std::max(grainSize, std::size_t(1));
+    const std::size_t chunkNum = (taskNum + grain - 1) / grain;
+    const std::size_t workerNum = std::min(get_thread_num(threadNum), chunkNum);
+
+    if (workerNum <= 1){
+        for (std::size_t taskIdx=0; taskIdx<taskNum; taskIdx++){
+            func(taskIdx);
+        }
+        return;
+    }
+
+    std::atomic<std::size_t> nextChunkIdx(0);
+    std::exception_ptr firstException = nullptr;
+    std::mutex exceptionMutex;
+
+    auto worker = [&](){
+        for (std::size_t chunkIdx = nextChunkIdx++; chunkIdx < chunkNum; chunkIdx = nextChunkIdx++){
+            const std::size_t start = chunkIdx * grain;
+            const std::size_t stop = std::min(start + grain, taskNum);
+            try{
+                for (std::size_t taskIdx=start; taskIdx<stop; taskIdx++){
+                    func(taskIdx);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(exceptionMutex);
+                if (!firstException){
+                    firstException = std::current_exception();
+                }
+                // stop handing out new chunks
+                nextChunkIdx = chunkNum;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(workerNum - 1);
+    for (std::size_t i=0; i<workerNum-1; i++){
+        threads.emplace_back(worker);
+    }
+    // the calling thread works as well
+    worker();
+    for (auto &thread : threads){
+        thread.join();
+    }
+
+    if (firstException){
+        std::rethrow_exception(firstException);
+    }
+}
+
+} // namespace reneu::utils
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RENEU_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+namespace reneu::utils{
+
+/**
+ * \brief the squared distances from a query point to a batch of points.
+ * The points are stored as structure of arrays, so the kernels can
+ * load 8 or 16 consecutive coordinates at once.
+ * \param xs, ys, zs: the coordinates of points
+ * \param pointNum: the number of points
+ * \param queryPoint: the x,y,z of query point
+ * \param squaredDists: output, should have space for pointNum floats
+ */
+using SquaredDistancesKernel = void (*)(const float *xs, const float *ys, const float *zs,
+                                        const std::size_t pointNum, const float *queryPoint,
+                                        float *squaredDists);
+
+inline void squared_distances_scalar(const float *xs, const float *ys, const float *zs,
+                                        const std::size_t pointNum, const float *queryPoint,
+                                        float *squaredDists){
+    for (std::size_t i=0; i<pointNum; i++){
+        const float dx = xs[i] - queryPoint[0];
+        const float dy = ys[i] - queryPoint[1];
+        const float dz = zs[i] - queryPoint[2];
+        squaredDists[i] = dx*dx + dy*dy + dz*dz;
+    }
+}
+
+#ifdef RENEU_X86_SIMD
+// the target attribute let us compile the kernels without -mavx2 for the whole module.
+// they are only called after checking the cpu at runtime.
+__attribute__((target("avx2,fma")))
+inline void squared_distances_avx2(const float *xs, const float *ys, const float *zs,
+                                        const std::size_t pointNum, const float *queryPoint,
+                                        float *squaredDists){
+    const __m256 qx = _mm256_set1_ps(queryPoint[0]);
+    const __m256 qy = _mm256_set1_ps(queryPoint[1]);
+    const __m256 qz = _mm256_set1_ps(queryPoint[2]);
+    std::size_t i = 0;
+    for (; i+8<=pointNum; i+=8){
+        const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs + i), qx);
+        const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys + i), qy);
+        const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(zs + i), qz);
+        __m256 d2 = _mm256_mul_ps(dx, dx);
+        d2 = _mm256_fmadd_ps(dy, dy, d2);
+        d2 = _mm256_fmadd_ps(dz, dz, d2);
+        _mm256_storeu_ps(squaredDists + i, d2);
+    }
+    squared_distances_scalar(xs+i, ys+i, zs+i, pointNum-i, queryPoint, squaredDists+i);
+}
+
+__attribute__((target("avx512f")))
+inline void squared_distances_avx512(const float *xs, const float *ys, const float *zs,
+                                        const std::size_t pointNum, const float *queryPoint,
+                                        float *squaredDists){
+    const __m512 qx = _mm512_set1_ps(queryPoint[0]);
+    const __m512 qy = _mm512_set1_ps(queryPoint[1]);
+    const __m512 qz = _mm512_set1_ps(queryPoint[2]);
+    std::size_t i = 0;
+    for (; i+16<=pointNum; i+=16){
+        const __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(xs + i), qx);
+        const __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(ys + i), qy);
+        const __m512 dz = _mm512_sub_ps(_mm512_loadu_ps(zs + i), qz);
+        __m512 d2 = _mm512_mul_ps(dx, dx);
+        d2 = _mm512_fmadd_ps(dy, dy, d2);
+        d2 = _mm512_fmadd_ps(dz, dz, d2);
+        _mm512_storeu_ps(squaredDists + i, d2);
+    }
+    if (i < pointNum){
+        // masked load and store of the tail
+        const __mmask16 mask = (__mmask16)((1u << (pointNum - i)) - 1u);
+        const __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, xs + i), qx);
+        const __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, ys + i), qy);
+        const __m512 dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, zs + i), qz);
+        __m512 d2 = _mm512_mul_ps(dx, dx);
+        d2 = _mm512_fmadd_ps(dy, dy, d2);
+        d2 = _mm512_fmadd_ps(dz, dz, d2);
+        _mm512_mask_storeu_ps(squaredDists + i, mask, d2);
+    }
+}
+#endif
+
+/**
+ * \brief pick the widest kernel supported by current cpu.
+ */
+inline SquaredDistancesKernel select_squared_distances_kernel(){
+#ifdef RENEU_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")){
+        return squared_distances_avx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        return squared_distances_avx2;
+    }
+#endif
+    return squared_distances_scalar;
+}
+
+inline void squared_distances(const float *xs, const float *ys, const float *zs,
+                                const std::size_t pointNum, const float *queryPoint,
+                                float *squaredDists){
+    // the cpu is only checked once
+    static const SquaredDistancesKernel kernel = select_squared_distances_kernel();
+    kernel(xs, ys, zs, pointNum, queryPoint, squaredDists);
+}
+
+} // namespace reneu::utils
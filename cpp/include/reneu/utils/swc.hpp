@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+
+#include "reneu/utils/mmap.hpp"
+
+// the floating point charconv is not available in old standard libraries,
+// such as GCC before 11 and libc++ of macOS.
+// define RENEU_NO_FLOAT_CHARCONV to build the fallback with strtof and snprintf anyway.
+#if defined(__cpp_lib_to_chars) && !defined(RENEU_NO_FLOAT_CHARCONV)
+#define RENEU_FLOAT_CHARCONV
+#endif
+
+
+namespace reneu::utils{
+
+/**
+ * \brief the points of a SWC file sorted by point id.
+ * The point ids are dropped, and the parents are the row indices
+ * rather than point ids. The root points have parent -2.
+ */
+struct SWCRecords{
+    std::vector<int> classes;
+    // x, y, z, r of each point
+    std::vector<float> points;
+    std::vector<int> parents;
+
+    inline std::size_t size() const {
+        return classes.size();
+    }
+};
+
+/**
+ * \brief parse a number at the start of text after the spaces and tabs.
+ * \return the position after the number, nullptr if there is no number.
+ */
+template<class T>
+inline const char* parse_swc_field(const char *ptr, const char *end, T &value){
+    while (ptr < end && (*ptr == ' ' || *ptr == '\t')){
+        ptr++;
+    }
+    // from_chars do not accept the plus sign
+    if (ptr < end && *ptr == '+'){
+        ptr++;
+    }
+#ifndef RENEU_FLOAT_CHARCONV
+    if constexpr (std::is_floating_point_v<T>){
+        // The text is not null terminated, so the number is copied out for strtof.
+        char number[64];
+        const std::size_t length = std::min( static_cast<std::size_t>(
+                std::find_if(ptr, end, [](const char &c){
+                    return c == ' ' || c == '\t' || c == '\r' || c == '\n';}) - ptr ), 
+                sizeof(number) - 1 );
+        std::copy(ptr, ptr + length, number);
+        number[length] = '\0';
+        char *next;
+        value = std::strtof(number, &next);
+        if (next == number){
+            return nullptr;
+        }
+        return ptr + (next - number);
+    } else
+#endif
+    {
+        const auto [next, error] = std::from_chars(ptr, end, value);
+        if (error != std::errc()){
+            return nullptr;
+        }
+        return next;
+    }
+}
+
+/**
+ * \brief parse the text of a SWC file.
+ * The output is sized by the line number before parsing, so the vectors never grow.
+ * The unsorted point ids are sorted by a lookup table in linear time if they are
+ * dense, which is the normal case.
+ * \param name: the file name shown in the error messages
+ */
+inline SWCRecords parse_swc(const char *begin, const char *end,
+                                        const std::string &name = "swc"){
+    const std::size_t lineNum = std::count(begin, end, '\n') + 1;
+    std::vector<int> ids, classes, parentIds;
+    std::vector<float> points;
+    ids.reserve( lineNum );
+    classes.reserve( lineNum );
+    parentIds.reserve( lineNum );
+    points.reserve( 4 * lineNum );
+
+    std::size_t lineIdx = 0;
+    for (const char *lineStart = begin; lineStart < end; lineIdx++){
+        const char *lineStop = std::find(lineStart, end, '\n');
+        const char *ptr = lineStart;
+        lineStart = lineStop + 1;
+
+        while (ptr < lineStop && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r')){
+            ptr++;
+        }
+        if (ptr == lineStop || *ptr == '#'){
+            // empty line or comment
+            continue;
+        }
+
+        int id, pointClass, parentId;
+        float point[4];
+        ptr = parse_swc_field(ptr, lineStop, id);
+        if (ptr) ptr = parse_swc_field(ptr, lineStop, pointClass);
+        for (std::size_t i=0; i<4 && ptr; i++){
+            ptr = parse_swc_field(ptr, lineStop, point[i]);
+        }
+        if (ptr) ptr = parse_swc_field(ptr, lineStop, parentId);
+        if (!ptr){
+            throw std::runtime_error("invalid swc line " + std::to_string(lineIdx + 1) +
+                                        " in " + name);
+        }
+        ids.push_back( id );
+        classes.push_back( pointClass );
+        points.insert( points.end(), point, point + 4 );
+        parentIds.push_back( parentId );
+    }
+
+    // the input row of each point in the order of ids
+    const std::size_t pointNum = ids.size();
+    SWCRecords records;
+    if (pointNum == 0){
+        return records;
+    }
+    const auto [minIdIter, maxIdIter] = std::minmax_element(ids.begin(), ids.end());
+    const long long minId = *minIdIter;
+    const std::size_t idRange = static_cast<std::size_t>(*maxIdIter - minId) + 1;
+    // the sorted row of each point id, -1 if the id does not exist
+    std::vector<int> rowOfId;
+    std::vector<std::pair<int, int>> sortedIds;
+    std::vector<std::size_t> order;
+    order.reserve( pointNum );
+    if (idRange <= 4 * pointNum){
+        // the ids are dense, sort them with a lookup table
+        std::vector<int> inputRowOfId( idRange, -1 );
+        for (std::size_t row=0; row<pointNum; row++){
+            int &inputRow = inputRowOfId[ ids[row] - minId ];
+            if (inputRow >= 0){
+                throw std::runtime_error("duplicate swc point id " +
+                                        std::to_string(ids[row]) + " in " + name);
+            }
+            inputRow = row;
+        }
+        rowOfId.assign( idRange, -1 );
+        for (std::size_t idx=0; idx<idRange; idx++){
+            if (inputRowOfId[idx] >= 0){
+                rowOfId[idx] = order.size();
+                order.push_back( inputRowOfId[idx] );
+            }
+        }
+    } else {
+        sortedIds.resize( pointNum );
+        for (std::size_t row=0; row<pointNum; row++){
+            sortedIds[row] = std::make_pair( ids[row], static_cast<int>(row) );
+        }
+        std::sort(sortedIds.begin(), sortedIds.end());
+        for (std::size_t row=0; row<pointNum; row++){
+            if (row > 0 && sortedIds[row].first == sortedIds[row-1].first){
+                throw std::runtime_error("duplicate swc point id " +
+                                    std::to_string(sortedIds[row].first) + " in " + name);
+            }
+            order.push_back( sortedIds[row].second );
+        }
+    }
+
+    auto find_row = [&](const int &id) -> int {
+        if (!rowOfId.empty()){
+            const long long idx = id - minId;
+            return (idx < 0 || idx >= static_cast<long long>(idRange)) ? -1 : rowOfId[idx];
+        }
+        const auto iter = std::lower_bound(sortedIds.begin(), sortedIds.end(),
+                                            std::make_pair(id, -1));
+        return (iter == sortedIds.end() || iter->first != id) ? -1 :
+                                                    static_cast<int>(iter - sortedIds.begin());
+    };
+
+    records.classes.resize( pointNum );
+    records.points.resize( 4 * pointNum );
+    records.parents.resize( pointNum );
+    for (std::size_t row=0; row<pointNum; row++){
+        const std::size_t inputRow = order[row];
+        records.classes[row] = classes[inputRow];
+        std::copy(&points[4*inputRow], &points[4*inputRow] + 4, &records.points[4*row]);
+        const int parentId = parentIds[inputRow];
+        if (parentId < 0){
+            // root point id is -2 rather than -1.
+            records.parents[row] = -2;
+        } else {
+            const int parentRow = find_row( parentId );
+            if (parentRow < 0){
+                throw std::runtime_error("missing swc parent point id " +
+                                        std::to_string(parentId) + " in " + name);
+            }
+            records.parents[row] = parentRow;
+        }
+    }
+    return records;
+}
+
+/**
+ * \brief read a SWC file with memory map.
+ */
+inline SWCRecords read_swc(const std::string &fileName){
+    const MappedFile file( fileName );
+    return parse_swc( file.data(), file.data() + file.get_size(), fileName );
+}
+
+/**
+ * \brief the longest line of SWC text with a float precision.
+ * A fixed format float has at most 39 integer digits, a sign and a dot.
+ */
+inline std::size_t max_swc_line_size(const int &precision){
+    return 3 * 11 + 4 * (41 + std::max(precision, 0)) + 7;
+}
+
+/**
+ * \brief format a point as a SWC line.
+ * The buffer should have max_swc_line_size(precision) bytes at least.
+ * \param point: x, y, z, r
+ * \return the position after the line
+ */
+inline char* format_swc_line(char *ptr, const int &id, const int &pointClass, 
+                    const float *point, const int &parentId, const int &precision){
+    // the buffer is large enough, so the errors are not checked
+    char *end = ptr + max_swc_line_size( precision );
+    ptr = std::to_chars(ptr, end, id).ptr;
+    *ptr++ = ' ';
+    ptr = std::to_chars(ptr, end, pointClass).ptr;
+    for (std::size_t i=0; i<4; i++){
+        *ptr++ = ' ';
+#ifdef RENEU_FLOAT_CHARCONV
+        ptr = std::to_chars(ptr, end, point[i], std::chars_format::fixed, precision).ptr;
+#else
+        ptr += std::snprintf(ptr, end - ptr, "%.*f", precision, point[i]);
+#endif
+    }
+    *ptr++ = ' ';
+    ptr = std::to_chars(ptr, end, parentId).ptr;
+    *ptr++ = '\n';
+    return ptr;
+}
+
+/**
+ * \brief the commented header of SWC files written by us.
+ * This is thread safe, unlike std::ctime.
+ */
+inline std::string make_swc_header(){
+    const std::time_t now = std::chrono::system_clock::to_time_t( 
+                                        std::chrono::system_clock::now() );
+    std::tm localTime;
+    localtime_r( &now, &localTime );
+    // the same format with std::ctime
+    char timeString[64];
+    std::strftime( timeString, sizeof(timeString), "%a %b %e %H:%M:%S %Y", &localTime );
+    return std::string("# Created using reneu at ") + timeString + 
+                    "\n# https://github.com/jingpengw/reneu \n";
+}
+
+} // namespace reneu::utils
@@ -47,7 +47,8 @@ PYBIND11_MODULE(libreneu, m) {
         .def("translate_centroid_to_origin", &Skeleton::translate_centroid_to_origin)
         .def("downsample", &Skeleton::downsample)
         .def("to_swc_str", &Skeleton::to_swc_str)
-        .def("write_swc", &Skeleton::write_swc)
+        .def("write_swc", &Skeleton::write_swc, 
+                py::arg("file_name"), py::arg("precision")=3)
         .def(py::pickle(
             [](const Skeleton &sk){ // __getstate__
                 return py::make_tuple( sk.get_py_points(), sk.get_py_attributes() );
@@ -60,9 +61,49 @@ PYBIND11_MODULE(libreneu, m) {
             }
         ));
 
+    // return the skeletons, their file names and the errors of bad files
+    m.def("read_swc_files", &read_swc_files, 
+            py::arg("file_names"), py::arg("thread_num")=0, 
+            py::call_guard<py::gil_scoped_release>());
+    m.def("read_swc_directory", &read_swc_directory, 
+            py::arg("dir_name"), py::arg("thread_num")=0, 
+            py::call_guard<py::gil_scoped_release>());
+    m.def("write_swc_files", &write_swc_files, 
+            py::arg("skeletons"), py::arg("file_names"), py::arg("precision")=3, 
+            py::arg("thread_num")=0, py::call_guard<py::gil_scoped_release>());
+
     py::class_<KDTree>(m, "XKDTree")
-        .def(py::init<const PyPoints &, const Index &>())
-        .def("knn", &KDTree::py_knn);
+        .def(py::init<const PyPoints &, const Index &, const std::size_t &>(), 
+                py::arg("points"), py::arg("leaf_size"), py::arg("thread_num")=0)
+        // memory map a tree file saved by save
+        .def(py::init<const std::string &>())
+        .def("save", &KDTree::save)
+        .def("knn", &KDTree::py_knn)
+        .def("knn_batch", &KDTree::py_knn_batch, 
+                py::arg("query_points"), py::arg("K"), py::arg("thread_num")=0)
+        .def("knn_batch_with_squared_distances", 
+                &KDTree::py_knn_batch_with_squared_distances, 
+                py::arg("query_points"), py::arg("K"), py::arg("thread_num")=0)
+        .def("knn_approximate", &KDTree::py_knn_approximate, 
+                py::arg("query_point"), py::arg("K"), py::arg("epsilon")=0.f,
+                py::arg("max_leaf_num")=std::numeric_limits<Index>::max())
+        .def("radius_search", &KDTree::py_radius_search)
+        .def("radius_search_with_squared_distances", 
+                &KDTree::py_radius_search_with_squared_distances, 
+                py::arg("query_point"), py::arg("radius"))
+        .def("radius_count", &KDTree::py_radius_count, 
+                py::arg("query_points"), py::arg("radius"), py::arg("thread_num")=0)
+        .def("dual_tree_nearest_neighbors", &KDTree::dual_tree_nearest_neighbors, 
+                py::arg("query_tree"), py::call_guard<py::gil_scoped_release>())
+        // the state is the binary format of save
+        .def(py::pickle(
+            [](const KDTree &kdTree){ // __getstate__
+                return py::bytes( kdTree.to_bytes() );
+            },
+            [](const py::bytes &state){ // __setstate__
+                return KDTree::from_bytes( state );
+            }
+        ));
         
 
     py::class_<ScoreTable>(m, "XNBLASTScoreTable")
@@ -72,41 +113,154 @@ PYBIND11_MODULE(libreneu, m) {
         .def_property_readonly("table", &ScoreTable::get_pytable)
         // python do not have single precision number!
         .def("__getitem__", py::overload_cast<const std::tuple<float, float>&>(
-                                    &ScoreTable::operator()), "get table item");
+                                    &ScoreTable::operator()), "get table item")
+        .def("sum", &ScoreTable::py_sum, py::arg("squared_distances"), 
+                py::arg("absolute_dot_products"), py::arg("kernel")="auto");
+
+    m.def("has_score_sum_avx2", &has_score_sum_avx2);
     
     py::class_<VectorCloud>(m, "XVectorCloud")
-        .def(py::init<const PyPoints &, const Index &, const Index &>())
-        .def_property_readonly("vectors", &VectorCloud::get_vectors)
+        .def(py::init<const PyPoints &, const Index &, const Index &, const std::size_t &>(), 
+                py::arg("points"), py::arg("leaf_size"), py::arg("nearest_point_num"), 
+                py::arg("thread_num")=0)
+        .def_property_readonly("vectors", &VectorCloud::get_py_vectors)
+        // the input index of each point in the Morton order used internally
+        .def_property_readonly("point_indices", &VectorCloud::get_py_point_indices)
         .def("__len__", &VectorCloud::size)
         .def("query_by_self", &VectorCloud::query_by_self)
-        .def("query_by", &VectorCloud::query_by)
+        // trade memory for the speed of targets queried many times
+        .def("build_nearest_point_grid", py::overload_cast<const float &, 
+                    const ScoreTable &, const std::size_t &>(
+                                    &VectorCloud::build_nearest_point_grid), 
+                py::arg("resolution"), py::arg("score_table"), py::arg("thread_num")=0, 
+                py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("has_nearest_point_grid", 
+                                &VectorCloud::has_nearest_point_grid)
+        .def("query_by", &VectorCloud::query_by, 
+                py::arg("query"), py::arg("score_table"), 
+                py::arg("cutoff")=std::numeric_limits<float>::lowest(), 
+                py::arg("approximate_far_pairs")=false)
+        // the nearest neighbor search strategies chosen by query_by
+        .def("query_by_dual_tree", &VectorCloud::query_by_dual_tree, 
+                py::arg("query"), py::arg("score_table"), 
+                py::arg("cutoff")=std::numeric_limits<float>::lowest())
+        .def("query_by_single_tree", 
+            [](const VectorCloud &vc, const VectorCloud &query, const ScoreTable &scoreTable, 
+                    const float &cutoff){
+                return vc.query_by_single_tree( query, scoreTable, 
+                                                scoreTable.max_score(), cutoff );
+            }, py::arg("query"), py::arg("score_table"), 
+                py::arg("cutoff")=std::numeric_limits<float>::lowest())
         // make it pickleable for distributed processing
         .def(py::pickle(
             [](const VectorCloud &vc) { // __getstate__
                 // Return a tuple that fully encodes the state of the object
+                // the nearest point grid could be large, only its parameters are kept.
+                py::object gridState = py::none();
+                if (vc.has_nearest_point_grid()){
+                    const auto &grid = vc.get_nearest_point_grid();
+                    gridState = py::make_tuple( grid->get_resolution(), 
+                                                grid->get_max_distance() );
+                }
                 return py::make_tuple(  vc.get_py_points(), 
                                         vc.get_py_vectors(), 
-                                        vc.get_kd_tree_serializable_tuple() );
+                                        py::bytes(vc.get_kd_tree().to_bytes()), 
+                                        vc.get_py_point_indices(), 
+                                        gridState );
             },
             [](py::tuple tp) { // __setstate__
-                if (tp.size() != 3)
+                if (tp.size() != 5)
                     throw std::runtime_error("Invalid state!");
                 // create a new C++ instance
                 VectorCloud vc( tp[0].cast<PyPoints>(), tp[1].cast<PyPoints>(), 
-                                tp[2].cast<KDTree>());
+                                KDTree::from_bytes(tp[2].cast<std::string>()), 
+                                tp[3].cast<std::vector<Index>>() );
+                if (!tp[4].is_none()){
+                    // rebuild the grid with one thread, the unpickling workers 
+                    // normally run in parallel processes already.
+                    const auto gridState = tp[4].cast<std::tuple<float, float>>();
+                    vc.build_nearest_point_grid( std::get<0>(gridState), 
+                                                 std::get<1>(gridState), 1 );
+                }
                 return vc;
             }
         ));
 
+    // quantized points and 8 bits octahedral vectors in bucket order
+    py::class_<CompactVectorCloud<std::int8_t>>(m, "XCompactVectorCloud")
+        .def(py::init<const VectorCloud &, const float &, const std::size_t &>(), 
+                py::arg("vector_cloud"), py::arg("resolution"), py::arg("thread_num")=0)
+        .def_property_readonly("points", &CompactVectorCloud<std::int8_t>::get_py_points)
+        .def_property_readonly("vectors", &CompactVectorCloud<std::int8_t>::get_py_vectors)
+        .def_property_readonly("nbytes", &CompactVectorCloud<std::int8_t>::get_byte_num)
+        .def("__len__", &CompactVectorCloud<std::int8_t>::size)
+        .def("query_by_self", &CompactVectorCloud<std::int8_t>::query_by_self)
+        .def("query_by", &CompactVectorCloud<std::int8_t>::query_by, 
+                py::arg("query"), py::arg("score_table"), 
+                py::arg("cutoff")=std::numeric_limits<float>::lowest(), 
+                py::arg("approximate_far_pairs")=false);
+
+    // the same with above but 16 bits octahedral vectors
+    py::class_<CompactVectorCloud<std::int16_t>>(m, "XCompactVectorCloud16")
+        .def(py::init<const VectorCloud &, const float &, const std::size_t &>(), 
+                py::arg("vector_cloud"), py::arg("resolution"), py::arg("thread_num")=0)
+        .def_property_readonly("points", &CompactVectorCloud<std::int16_t>::get_py_points)
+        .def_property_readonly("vectors", &CompactVectorCloud<std::int16_t>::get_py_vectors)
+        .def_property_readonly("nbytes", &CompactVectorCloud<std::int16_t>::get_byte_num)
+        .def("__len__", &CompactVectorCloud<std::int16_t>::size)
+        .def("query_by_self", &CompactVectorCloud<std::int16_t>::query_by_self)
+        .def("query_by", &CompactVectorCloud<std::int16_t>::query_by, 
+                py::arg("query"), py::arg("score_table"), 
+                py::arg("cutoff")=std::numeric_limits<float>::lowest(), 
+                py::arg("approximate_far_pairs")=false);
+
+    // a memory mapped library of vector clouds
+    py::class_<VectorCloudLibrary>(m, "XVectorCloudLibrary")
+        .def(py::init<const std::string &>())
+        .def("__len__", &VectorCloudLibrary::size)
+        .def("__getitem__", &VectorCloudLibrary::get_vector_cloud)
+        .def_property_readonly("vector_clouds", [](const VectorCloudLibrary &library){
+                    return library.get_vector_clouds();})
+        .def("get_vector_clouds", &VectorCloudLibrary::get_vector_clouds, 
+                py::arg("start")=0, py::arg("stop")=std::numeric_limits<Index>::max())
+        .def_property_readonly("self_scores", &VectorCloudLibrary::get_self_scores)
+        .def_property_readonly("bounding_boxes", &VectorCloudLibrary::get_bounding_boxes);
+    m.def("save_vector_clouds", &save_vector_clouds, 
+            py::arg("file_name"), py::arg("vector_clouds"), py::arg("score_table"));
+
     py::class_<NBLASTScoreMatrix>(m, "XNBLASTScoreMatrix")
         //.def(py::init<const py::list &, const ScoreTable &>())
         // Note that the conversion from python list to std::vector has copy overhead
-        .def(py::init<const std::vector<VectorCloud> &, const ScoreTable &>())
+        .def(py::init<const std::vector<VectorCloud> &, const ScoreTable &, const Index &>(), 
+                py::arg("vector_clouds"), py::arg("score_table"), py::arg("thread_num")=0, 
+                py::call_guard<py::gil_scoped_release>())
+        // merged from blocks of raw scores
+        .def(py::init<const PyPoints &>(), py::arg("raw_score_matrix"))
+        .def("update", &NBLASTScoreMatrix::update, 
+                py::arg("vector_clouds"), py::arg("changed_indices"), py::arg("score_table"), 
+                py::arg("thread_num")=0, py::call_guard<py::gil_scoped_release>())
         .def_property_readonly("raw_score_matrix", &NBLASTScoreMatrix::get_raw_score_matrix)
         .def_property_readonly("normalized_score_matrix", 
                                 &NBLASTScoreMatrix::get_normalized_score_matrix)
         .def_property_readonly("mean_score_matrix", 
                                 &NBLASTScoreMatrix::get_mean_score_matrix);
+
+    // the rows of scores are queries and the columns are targets
+    m.def("nblast_query_targets", &py_query_targets, 
+            py::arg("queries"), py::arg("targets"), py::arg("score_table"), 
+            py::arg("scores").noconvert(), py::arg("thread_num")=0, 
+            py::arg("approximate_far_pairs")=false, 
+            py::call_guard<py::gil_scoped_release>());
+    m.def("nblast_query_targets_to_file", &query_targets_to_file, 
+            py::arg("queries"), py::arg("targets"), py::arg("score_table"), 
+            py::arg("file_name"), py::arg("thread_num")=0, 
+            py::arg("approximate_far_pairs")=false, 
+            py::call_guard<py::gil_scoped_release>());
+    // return the query indices, target indices and raw scores of best matches
+    m.def("nblast_search_targets", &search_targets, 
+            py::arg("queries"), py::arg("targets"), py::arg("score_table"), 
+            py::arg("top_k")=10, py::arg("threshold")=std::numeric_limits<float>::lowest(), 
+            py::arg("thread_num")=0, py::call_guard<py::gil_scoped_release>());
         
 
 
@@ -1,5 +1,12 @@
+import os
+import json
+from dataclasses import dataclass, asdict
+
 import numpy as np
 
+from .libreneu import XNBLASTScoreTable, XNBLASTScoreMatrix, XVectorCloudLibrary
+from .libreneu import nblast_query_targets_to_file
+
 def raw2normalized(score_matrix: np.ndarray):
     N = score_matrix.shape[0]
     self_score = score_matrix[range(N), range(N)]
@@ -11,3 +18,91 @@ def raw2normalized(score_matrix: np.ndarray):
 def normalized2mean(normalized_score_matrix: np.ndarray):
     assert normalized_score_matrix.max() == 1
     return (normalized_score_matrix + normalized_score_matrix.transpose()) / 2
+
+
+@dataclass
+class BlockJob:
+    """A block of NBLAST score matrix computed by one process.
+
+    All the jobs share one vector cloud library saved by `save_vector_clouds`.
+    The rows of score matrix are targets and the columns are queries,
+    the same with `XNBLASTScoreMatrix`.
+
+    Parameters
+    ----------
+    library_path: the vector cloud library file
+    target_start, target_stop: the range of target clouds in library
+    query_start, query_stop: the range of query clouds in library
+    output_path: the .npy file of block scores. The rows are queries and 
+        the columns are targets. 
+    """
+    library_path: str
+    target_start: int
+    target_stop: int
+    query_start: int
+    query_stop: int
+    output_path: str
+
+    @classmethod
+    def from_json(cls, spec: str):
+        return cls(**json.loads(spec))
+
+    def to_json(self):
+        return json.dumps(asdict(self))
+
+    @property
+    def is_done(self):
+        return os.path.exists(self.output_path)
+
+    def run(self, score_table: XNBLASTScoreTable = None, thread_num: int = 0):
+        if self.is_done:
+            # finished in a previous run
+            return
+        if score_table is None:
+            score_table = XNBLASTScoreTable()
+        library = XVectorCloudLibrary(self.library_path)
+        targets = library.get_vector_clouds(self.target_start, self.target_stop)
+        queries = library.get_vector_clouds(self.query_start, self.query_stop)
+        # an interrupted job only leaves the temporary file, so it will be rerun
+        tmp_path = self.output_path + '.tmp'
+        nblast_query_targets_to_file(queries, targets, score_table, tmp_path, 
+                                        thread_num=thread_num)
+        os.replace(tmp_path, self.output_path)
+
+def make_block_jobs(library_path: str, block_size: int, output_dir: str):
+    """split the all-vs-all score matrix of a library into blocks."""
+    cloud_num = len(XVectorCloudLibrary(library_path))
+    jobs = []
+    for target_start in range(0, cloud_num, block_size):
+        for query_start in range(0, cloud_num, block_size):
+            output_path = os.path.join(output_dir, 
+                                        f'block_{target_start}_{query_start}.npy')
+            jobs.append(BlockJob(library_path, 
+                                target_start, min(target_start + block_size, cloud_num),
+                                query_start, min(query_start + block_size, cloud_num),
+                                output_path))
+    return jobs
+
+def merge_block_jobs(jobs: list):
+    """combine the finished blocks into a score matrix.
+
+    The raw, normalized and mean matrices are properties of the returned matrix.
+    """
+    library = XVectorCloudLibrary(jobs[0].library_path)
+    self_scores = library.self_scores
+    cloud_num = len(self_scores)
+    raw_score_matrix = np.zeros((cloud_num, cloud_num), dtype=np.float32)
+    covered = np.zeros((cloud_num, cloud_num), dtype=bool)
+    for job in jobs:
+        if not job.is_done:
+            raise RuntimeError(f'the block job is not finished: {job.to_json()}')
+        block = np.load(job.output_path)
+        raw_score_matrix[job.target_start:job.target_stop, 
+                         job.query_start:job.query_stop] = block.transpose()
+        covered[job.target_start:job.target_stop, job.query_start:job.query_stop] = True
+    if not np.all(covered):
+        raise RuntimeError('the blocks do not cover the whole score matrix.')
+
+    # the self scores of library are the same with the ones in XNBLASTScoreMatrix
+    raw_score_matrix[range(cloud_num), range(cloud_num)] = self_scores
+    return XNBLASTScoreMatrix(raw_score_matrix)
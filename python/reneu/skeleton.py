@@ -1,5 +1,5 @@
 import numpy as np
-from .libreneu import XSkeleton
+from .libreneu import XSkeleton, read_swc_files, read_swc_directory, write_swc_files
 import struct
 from io import BytesIO
 
@@ -67,10 +67,8 @@ class Skeleton(XSkeleton):
             we can drop the point index column after order it. Our future
             analysis assumes that the points are ordered.
         """
-        # numpy load text is faster than my c++ implementation!
-        # it might use memory map internally
-        swc_array = np.loadtxt(file_name, dtype=np.float32)
-        return cls( swc_array )
+        # the native reader maps the file and sorts the point ids
+        return cls( file_name )
 
     def to_swc(self, file_name: str, precision: int = 3):
         """
@@ -179,6 +177,48 @@ class Skeleton(XSkeleton):
                                     self.attributes, other.attributes )
 
 
+def load_swc_files(paths, thread_num: int = 0):
+    """read SWC files in parallel without the GIL.
+
+    Parameters
+    ----------
+    paths: a directory of .swc files, or a list of file paths
+    thread_num: the number of threads, 0 means all the hardware threads.
+
+    Returns
+    -------
+    skeletons: dict of file path to Skeleton
+    errors: dict of file path to the error message of bad files, 
+        they are skipped rather than aborting the batch.
+    """
+    if isinstance(paths, str):
+        xskeletons, file_names, errors = read_swc_directory(paths, thread_num=thread_num)
+    else:
+        xskeletons, file_names, errors = read_swc_files(list(paths), thread_num=thread_num)
+    skeletons = {file_name: Skeleton(sk.points, sk.attributes) 
+                            for file_name, sk in zip(file_names, xskeletons)}
+    return skeletons, errors
+
+
+def save_swc_files(skeletons: dict, precision: int = 3, thread_num: int = 0):
+    """write SWC files in parallel without the GIL.
+
+    Parameters
+    ----------
+    skeletons: dict of file path to Skeleton
+    precision: the digits used to write float number.
+    thread_num: the number of threads, 0 means all the hardware threads.
+
+    Returns
+    -------
+    errors: dict of file path to the error message of failed files, 
+        they are skipped rather than aborting the batch.
+    """
+    file_names = list(skeletons.keys())
+    return write_swc_files([skeletons[f] for f in file_names], file_names, 
+                            precision=precision, thread_num=thread_num)
+
+
 def compare_points(points1, points2, K = 600):
     fig = plt.figure()
     ax = fig.gca(projection='3d')
@@ -57,6 +57,8 @@ ext_modules = [
             # '-Og',
             '-O3',
             '-ffast-math',
+            # std::thread is used for multi-threading
+            '-pthread',
             # build with debug info
             # '-g'
             # this is not working
@@ -107,7 +109,7 @@ class BuildExt(build_ext):
     l_opts = {
         'msvc': [],
         # link to cblas library to solve undefined symbol issue
-        'unix': ['-lcblas',],
+        'unix': ['-lcblas', '-pthread'],
     }
     
     if sys.platform == 'darwin':
@@ -2,15 +2,22 @@ import faulthandler
 faulthandler.enable()
 
 import os
-# import pickle
+import tempfile
+import pytest
+import pickle
 import numpy as np
 from math import isclose
 from copy import deepcopy
 from time import time
 
-from reneu.libreneu import XNBLASTScoreTable
+from reneu.libreneu import XNBLASTScoreTable, has_score_sum_avx2
 from reneu.skeleton import Skeleton
 from reneu.libreneu import XVectorCloud, XNBLASTScoreMatrix
+from reneu.libreneu import nblast_query_targets, nblast_query_targets_to_file
+from reneu.libreneu import nblast_search_targets
+from reneu.libreneu import XVectorCloudLibrary, save_vector_clouds
+from reneu.libreneu import XCompactVectorCloud, XCompactVectorCloud16
+from reneu.nblast import BlockJob, make_block_jobs, merge_block_jobs
 
 DATA_DIR = os.path.join(os.path.dirname(__file__), '../data/')
 #DATA_DIR = 'data/'
@@ -32,14 +39,46 @@ def test_nblast_score_table():
     assert isclose(st[16011.2, 1], -1.31413, abs_tol=1e-4)
     assert isclose(st[15000, 1], -0.892505829, abs_tol=1e-4)
 
+def test_score_sum_kernels():
+    if not has_score_sum_avx2():
+        pytest.skip('the cpu does not support avx2')
+    # integer scores are summed exactly in any order
+    table = np.arange(210, dtype=np.float32).reshape(21, 10)
+    int_st = XNBLASTScoreTable(table)
+    thresholds = np.asarray([750, 1500, 2000, 2500, 3000, 3500, 4000, 5000, 6000, 7000, 
+        8000, 9000, 10000, 12000, 14000, 16000, 20000, 25000, 30000, 40000], dtype=np.float32)
+    squared_thresholds = thresholds * thresholds
+    squared_distances = np.concatenate([
+        np.asarray([0, 1e12], dtype=np.float32), squared_thresholds,
+        np.nextafter(squared_thresholds, np.float32(0)), 
+        np.nextafter(squared_thresholds, np.float32(np.inf))])
+    adp_edges = np.arange(11, dtype=np.float32) / np.float32(10)
+    adp_edges = np.concatenate([adp_edges, adp_edges + np.float32(1e-5)])
+    absolute_dot_products = np.concatenate([adp_edges,
+        np.nextafter(adp_edges, np.float32(0)), np.nextafter(adp_edges, np.float32(1))])
+    absolute_dot_products = np.clip(absolute_dot_products, 0, 1)
+    squared_distances, absolute_dot_products = np.meshgrid(
+                            squared_distances, absolute_dot_products)
+    # one more pair to exercise the scalar tail of avx2 kernel
+    squared_distances = np.append(squared_distances.flatten(), np.float32(1))
+    absolute_dot_products = np.append(absolute_dot_products.flatten(), np.float32(0.5))
+    
+    # every chunk of 8 pairs is summed in one vector
+    for i in range(0, squared_distances.size, 8):
+        assert int_st.sum(squared_distances[i:i+8], absolute_dot_products[i:i+8], 'avx2') == \
+            int_st.sum(squared_distances[i:i+8], absolute_dot_products[i:i+8], 'scalar')
+    scalar_sum = int_st.sum(squared_distances, absolute_dot_products, 'scalar')
+    assert int_st.sum(squared_distances, absolute_dot_products, 'avx2') == scalar_sum
+    assert int_st.sum(squared_distances, absolute_dot_products) == scalar_sum
+
 def test_nblast_with_fake_data():
     point_num = 100
     points = np.zeros((point_num, 3), dtype=np.float32)
     points[:, 2] = np.arange(0, point_num)
     vc = XVectorCloud(points, 10, 2)
     # use version 2 of pickle
-    # this is not working because kdtree is not pickleable
-    # data = pickle.dumps(vc, 2)
+    data = pickle.dumps(vc, 2)
+    np.testing.assert_array_equal(pickle.loads(data).vectors, vc.vectors)
     true_vectors = np.repeat(np.array([[0,0,1]]), point_num, axis=0 )
     fake_vectors = deepcopy(vc.vectors)
     # there is a mixture of 1 and -1, both are correct
@@ -59,6 +98,269 @@ def test_nblast_with_fake_data():
     score = vc.query_by(vc2, st)
     assert isclose(-0.892506 * point_num, score, rel_tol=1e-2)
 
+def test_vector_cloud_directions():
+    np.random.seed(3)
+    points = np.cumsum(np.random.rand(200, 3) - 0.3, axis=0).astype(np.float32)
+    k = 10
+    vc = XVectorCloud(points, 10, k)
+    squared_distances = np.sum((points[:, None, :] - points[None, :, :])**2, axis=2)
+    for point_idx in range(points.shape[0]):
+        neighbors = points[np.argsort(squared_distances[point_idx, :])[:k], :]
+        _, _, vh = np.linalg.svd(neighbors - neighbors.mean(axis=0))
+        # the direction could be flipped
+        assert isclose(abs(np.dot(vh[0, :], vc.vectors[point_idx, :])), 1, abs_tol=1e-3)
+
+    # the vectors do not depend on the number of threads
+    np.testing.assert_array_equal(XVectorCloud(points, 10, k, thread_num=1).vectors, 
+                                  vc.vectors)
+
+def test_vector_cloud_point_indices():
+    np.random.seed(6)
+    points = np.random.rand(300, 3).astype(np.float32) * 1000
+    vc = XVectorCloud(points, 10, 10)
+    # the points are reordered internally, but the outputs are in input order
+    np.testing.assert_array_equal(np.sort(vc.point_indices), np.arange(300))
+    # the order is kept in library
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        file_name = os.path.join(tmp_dir, 'library.bin')
+        save_vector_clouds(file_name, [vc], st)
+        library_vc = XVectorCloudLibrary(file_name)[0]
+        np.testing.assert_array_equal(library_vc.point_indices, vc.point_indices)
+        np.testing.assert_array_equal(library_vc.vectors, vc.vectors)
+        assert library_vc.query_by(vc, st) == vc.query_by(vc, st)
+
+def test_vector_cloud_pickle():
+    np.random.seed(7)
+    points = np.cumsum(np.random.rand(500, 3) * 1000, axis=0).astype(np.float32)
+    vc = XVectorCloud(points, 10, 10)
+    query = XVectorCloud(points + 300, 10, 10)
+    vc2 = pickle.loads(pickle.dumps(vc))
+    np.testing.assert_array_equal(vc2.vectors, vc.vectors)
+    np.testing.assert_array_equal(vc2.point_indices, vc.point_indices)
+    assert not vc2.has_nearest_point_grid
+    assert vc2.query_by(query, st) == vc.query_by(query, st)
+
+    # the grid is rebuilt after unpickling
+    vc.build_nearest_point_grid(100, st)
+    vc3 = pickle.loads(pickle.dumps(vc))
+    assert vc3.has_nearest_point_grid
+    np.testing.assert_array_equal(vc3.point_indices, vc.point_indices)
+    assert vc3.query_by(query, st) == vc.query_by(query, st)
+
+def test_nblast_far_pairs():
+    point_num = 100
+    points = np.zeros((point_num, 3), dtype=np.float32)
+    points[:, 2] = np.arange(0, point_num) * 100
+    vc = XVectorCloud(points, 10, 10)
+    far_points = deepcopy(points)
+    far_points[:, 0] += 1e6
+    far_vc = XVectorCloud(far_points, 10, 10)
+
+    score = vc.query_by(far_vc, st)
+    far_score = vc.query_by(far_vc, st, approximate_far_pairs=True)
+    assert isclose(far_score, point_num * np.max(st.table[-1, :]), rel_tol=1e-5)
+    # the closed form score is the best case of last row of table
+    assert far_score >= score
+    assert isclose(far_score, score, rel_tol=0.05)
+
+    # a cutoff above the best case stops early
+    assert vc.query_by(far_vc, st, cutoff=far_score + 1) < far_score + 1
+    # the overlapping clouds are scored exactly
+    assert vc.query_by(vc, st, approximate_far_pairs=True) == vc.query_by(vc, st)
+
+def test_nblast_dual_tree():
+    # just above the point number to switch to dual tree search
+    np.random.seed(3)
+    point_num = 4100
+    def random_cloud():
+        return XVectorCloud(np.cumsum(np.random.rand(point_num, 3) * 100, axis=0
+                                        ).astype(np.float32), 10, 10)
+    target = random_cloud()
+    query = random_cloud()
+    score = target.query_by(query, st)
+    assert score == target.query_by_dual_tree(query, st)
+    assert isclose(score, target.query_by_single_tree(query, st), rel_tol=1e-5)
+    # the cached node boxes are reused by the following queries
+    assert target.query_by(query, st) == score
+    assert isclose(query.query_by(target, st), 
+                    query.query_by_single_tree(target, st), rel_tol=1e-5)
+
+def test_nblast_score_matrix():
+    np.random.seed(0)
+    # more clouds than one block of score matrix
+    vcs = []
+    for _ in range(19):
+        points = np.cumsum(np.random.rand(200, 3) * 1000, axis=0).astype(np.float32)
+        vcs.append( XVectorCloud(points, 10, 10) )
+
+    score_matrix = XNBLASTScoreMatrix(vcs, st, thread_num=4)
+    raw_score_matrix = score_matrix.raw_score_matrix
+    for target_idx, target in enumerate(vcs):
+        for query_idx, query in enumerate(vcs):
+            if target_idx == query_idx:
+                score = target.query_by_self(st)
+            else:
+                score = target.query_by(query, st)
+            assert isclose(raw_score_matrix[target_idx, query_idx], score, rel_tol=1e-5)
+
+    np.testing.assert_array_equal(
+        raw_score_matrix, XNBLASTScoreMatrix(vcs, st, thread_num=1).raw_score_matrix)
+
+def test_nblast_score_matrix_update():
+    np.random.seed(6)
+    def random_cloud():
+        points = np.cumsum(np.random.rand(200, 3) * 1000, axis=0).astype(np.float32)
+        return XVectorCloud(points, 10, 10)
+    vcs = [random_cloud() for _ in range(5)]
+    score_matrix = XNBLASTScoreMatrix(vcs, st)
+
+    # replace one cloud and append two new clouds
+    vcs[1] = random_cloud()
+    vcs.extend([random_cloud(), random_cloud()])
+    score_matrix.update(vcs, [1], st, thread_num=2)
+    
+    true_score_matrix = XNBLASTScoreMatrix(vcs, st)
+    np.testing.assert_allclose(score_matrix.raw_score_matrix, 
+                                true_score_matrix.raw_score_matrix, rtol=1e-5)
+    np.testing.assert_allclose(score_matrix.normalized_score_matrix, 
+                                true_score_matrix.normalized_score_matrix, rtol=1e-5)
+    np.testing.assert_allclose(score_matrix.mean_score_matrix, 
+                                true_score_matrix.mean_score_matrix, rtol=1e-5)
+
+def test_nblast_query_targets():
+    np.random.seed(1)
+    def random_clouds(num):
+        return [XVectorCloud(np.cumsum(np.random.rand(200, 3) * 1000, axis=0).astype(np.float32), 
+                                10, 10) for _ in range(num)]
+    queries = random_clouds(5)
+    targets = random_clouds(11)
+
+    scores = np.zeros((len(queries), len(targets)), dtype=np.float32)
+    nblast_query_targets(queries, targets, st, scores, thread_num=2)
+    for query_idx, query in enumerate(queries):
+        for target_idx, target in enumerate(targets):
+            assert isclose(scores[query_idx, target_idx], 
+                            target.query_by(query, st), rel_tol=1e-5)
+
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        file_name = os.path.join(tmp_dir, 'scores.npy')
+        nblast_query_targets_to_file(queries, targets, st, file_name)
+        np.testing.assert_array_equal(np.load(file_name, mmap_mode='r'), scores)
+
+    # the scores are written in C order, other layouts should be rejected
+    with pytest.raises(RuntimeError):
+        nblast_query_targets(queries, targets, st, np.asfortranarray(scores))
+    with pytest.raises(RuntimeError):
+        big = np.zeros((len(queries), 2 * len(targets)), dtype=np.float32)
+        nblast_query_targets(queries, targets, st, big[:, ::2])
+    with pytest.raises(RuntimeError):
+        read_only = np.zeros_like(scores)
+        read_only.flags.writeable = False
+        nblast_query_targets(queries, targets, st, read_only)
+
+def test_nblast_search_targets():
+    np.random.seed(2)
+    def random_clouds(num):
+        return [XVectorCloud(np.cumsum(np.random.rand(200, 3) * 1000, axis=0).astype(np.float32) + 
+                                np.random.rand(3).astype(np.float32) * 50000, 10, 10) 
+                                for _ in range(num)]
+    queries = random_clouds(4)
+    targets = random_clouds(30)
+    scores = np.zeros((len(queries), len(targets)), dtype=np.float32)
+    nblast_query_targets(queries, targets, st, scores)
+
+    top_k = 3
+    query_indices, target_indices, top_scores = nblast_search_targets(
+                                                    queries, targets, st, top_k=top_k)
+    assert len(query_indices) == len(queries) * top_k
+    for query_idx in range(len(queries)):
+        mask = (query_indices == query_idx)
+        np.testing.assert_allclose(top_scores[mask], 
+                                    np.sort(scores[query_idx, :])[::-1][:top_k], rtol=1e-5)
+        np.testing.assert_allclose(scores[query_idx, target_indices[mask]], 
+                                    top_scores[mask], rtol=1e-5)
+
+    threshold = np.median(scores)
+    query_indices, target_indices, top_scores = nblast_search_targets(
+                                    queries, targets, st, top_k=0, threshold=threshold)
+    assert len(top_scores) == np.count_nonzero(scores >= threshold)
+    assert np.all(top_scores >= threshold)
+
+def test_vector_cloud_library():
+    np.random.seed(4)
+    vcs = [XVectorCloud(np.cumsum(np.random.rand(300, 3) * 1000, axis=0).astype(np.float32), 
+                        10, 10) for _ in range(6)]
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        file_name = os.path.join(tmp_dir, 'library.bin')
+        save_vector_clouds(file_name, vcs, st)
+        library = XVectorCloudLibrary(file_name)
+        assert len(library) == len(vcs)
+        np.testing.assert_allclose(library.self_scores, 
+                                    [vc.query_by_self(st) for vc in vcs])
+        assert library.bounding_boxes.shape == (len(vcs), 6)
+
+        library_vcs = library.vector_clouds
+        for vc, library_vc in zip(vcs, library_vcs):
+            assert len(vc) == len(library_vc)
+            np.testing.assert_array_equal(vc.vectors, library_vc.vectors)
+        for query, library_query in zip(vcs, library_vcs):
+            assert library[0].query_by(library_query, st) == vcs[0].query_by(query, st)
+
+def test_nearest_point_grid():
+    np.random.seed(7)
+    vcs = [XVectorCloud(np.cumsum(np.random.rand(200, 3) * 200, axis=0).astype(np.float32), 
+                        10, 10) for _ in range(2)]
+    scores = [[target.query_by(query, st) for query in vcs] for target in vcs]
+    for vc in vcs:
+        vc.build_nearest_point_grid(1000., st)
+        assert vc.has_nearest_point_grid
+    # the nearest points are approximated by the ones of cell centers
+    for target, target_scores in zip(vcs, scores):
+        for query, score in zip(vcs, target_scores):
+            assert isclose(target.query_by(query, st), score, rel_tol=2e-2)
+
+def test_compact_vector_cloud():
+    np.random.seed(5)
+    vcs = [XVectorCloud(np.cumsum(np.random.rand(500, 3) * 1000, axis=0).astype(np.float32), 
+                        10, 10) for _ in range(3)]
+    for compact_type in (XCompactVectorCloud, XCompactVectorCloud16):
+        compacts = [compact_type(vc, 8.) for vc in vcs]
+        for vc, compact in zip(vcs, compacts):
+            assert len(compact) == len(vc)
+            # smaller than the float points and vectors
+            assert compact.nbytes < 2 * vc.vectors.nbytes
+            np.testing.assert_allclose(np.linalg.norm(compact.vectors, axis=1), 1, rtol=1e-5)
+        for target, compact_target in zip(vcs, compacts):
+            for query, compact_query in zip(vcs, compacts):
+                score = target.query_by(query, st)
+                compact_score = compact_target.query_by(compact_query, st)
+                assert isclose(score, compact_score, rel_tol=1e-2)
+        # the tree does not depend on the number of threads
+        compact = compact_type(vcs[0], 8., thread_num=2)
+        np.testing.assert_array_equal(compact.points, compacts[0].points)
+        assert compact.query_by(compacts[1], st) == compacts[0].query_by(compacts[1], st)
+
+def test_nblast_block_jobs():
+    np.random.seed(5)
+    vcs = [XVectorCloud(np.cumsum(np.random.rand(200, 3) * 1000, axis=0).astype(np.float32), 
+                        10, 10) for _ in range(7)]
+    score_matrix = XNBLASTScoreMatrix(vcs, st)
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        library_path = os.path.join(tmp_dir, 'library.bin')
+        save_vector_clouds(library_path, vcs, st)
+        jobs = make_block_jobs(library_path, 3, tmp_dir)
+        assert len(jobs) == 9
+        for job in jobs:
+            # the job spec is passed to another process
+            BlockJob.from_json(job.to_json()).run(score_table=st)
+            assert job.is_done
+
+        merged = merge_block_jobs(jobs)
+        np.testing.assert_allclose(merged.raw_score_matrix, 
+                                    score_matrix.raw_score_matrix, rtol=1e-5)
+        np.testing.assert_allclose(merged.mean_score_matrix, 
+                                    score_matrix.mean_score_matrix, rtol=1e-5)
+
 def test_nblast_with_real_data():   
     print('\n\n start testing nblast with real data.') 
     # the result from R NBLAST is :
@@ -102,5 +404,19 @@ def test_nblast_with_real_data():
 
 if __name__ == '__main__':
     test_nblast_score_table()
+    test_score_sum_kernels()
     test_nblast_with_fake_data()
+    test_vector_cloud_directions()
+    test_vector_cloud_point_indices()
+    test_vector_cloud_pickle()
+    test_nblast_far_pairs()
+    test_nblast_dual_tree()
+    test_nblast_score_matrix()
+    test_nblast_score_matrix_update()
+    test_nblast_query_targets()
+    test_nblast_search_targets()
+    test_vector_cloud_library()
+    test_nearest_point_grid()
+    test_compact_vector_cloud()
+    test_nblast_block_jobs()
     test_nblast_with_real_data()
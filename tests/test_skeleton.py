@@ -3,6 +3,8 @@ from os.path import dirname
 import time
 from math import isclose
 import pickle
+import shutil
+import tempfile
 
 import numpy as np
 
@@ -10,7 +12,7 @@ import faulthandler
 faulthandler.enable()
 
 from reneu.libreneu import XSkeleton
-from reneu.skeleton import Skeleton
+from reneu.skeleton import Skeleton, load_swc_files, save_swc_files
 
 NEURON_NAME = 'Nov10IR3e.CNG'
 #NEURON_NAME = '77337930247110714'
@@ -48,6 +50,59 @@ def test_xskeleton():
     print('downsampled from {} points to {} points.'.format(point_num1, point_num2))
 
 
+def test_read_swc():
+    swc_array = np.loadtxt(file_name, dtype=np.float32)
+    sk = XSkeleton(file_name)
+    np.testing.assert_array_equal(sk.points, Skeleton(swc_array).points)
+    np.testing.assert_array_equal(sk.attributes, Skeleton(swc_array).attributes)
+
+    # the point ids are unsorted and the lines are indented
+    temp_dir = tempfile.mkdtemp()
+    temp_file_name = joinpath(temp_dir, 'unsorted.swc')
+    with open(temp_file_name, 'w') as f:
+        f.write('# unsorted\n  3 2 1 0 0 1 1\n1 1 0 0 0 1 -1\n\t2 2 2 0 0 1 3\n')
+    sk = XSkeleton(temp_file_name)
+    np.testing.assert_array_equal(sk.points[:, 0], [0, 1, 2])
+    np.testing.assert_array_equal(sk.attributes[:, 1], [-2, 0, 1])
+    shutil.rmtree(temp_dir)
+
+
+def test_load_swc_files():
+    temp_dir = tempfile.mkdtemp()
+    good_file_name = joinpath(temp_dir, 'good.swc')
+    shutil.copy(file_name, good_file_name)
+    bad_file_name = joinpath(temp_dir, 'bad.swc')
+    with open(bad_file_name, 'w') as f:
+        f.write('1 1 0 0\n')
+
+    skeletons, errors = load_swc_files(temp_dir, thread_num=2)
+    assert list(skeletons.keys()) == [good_file_name]
+    assert skeletons[good_file_name] == Skeleton.from_swc(file_name)
+    assert list(errors.keys()) == [bad_file_name]
+
+    skeletons, errors = load_swc_files([good_file_name, joinpath(temp_dir, 'none.swc')])
+    assert len(skeletons) == 1 and len(errors) == 1
+    shutil.rmtree(temp_dir)
+
+
+def test_save_swc_files():
+    temp_dir = tempfile.mkdtemp()
+    sk = Skeleton.from_swc(file_name)
+    file_names = [joinpath(temp_dir, '{}.swc'.format(i)) for i in range(4)]
+    bad_file_name = joinpath(temp_dir, 'none', 'bad.swc')
+    skeletons = {f: sk for f in file_names + [bad_file_name]}
+
+    errors = save_swc_files(skeletons, precision=3, thread_num=2)
+    assert list(errors.keys()) == [bad_file_name]
+    swc_str = sk.to_swc_str(3)
+    for f in file_names:
+        with open(f) as fin:
+            # the header contains the time
+            assert fin.read().splitlines()[2:] == swc_str.splitlines()[2:]
+        assert Skeleton.from_swc(f) == sk
+    shutil.rmtree(temp_dir)
+
+
 def test_skeleton():
     print('\ntest inherited skeleton class in python...')
     start = time.process_time()
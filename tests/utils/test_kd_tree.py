@@ -1,6 +1,11 @@
 import faulthandler
 faulthandler.enable()
 
+import os
+import tempfile
+import pickle
+import struct
+import pytest
 import numpy as np
 from scipy.spatial import KDTree
 
@@ -92,5 +97,160 @@ def test_large_fake_array():
     assert len(set(nearest_point_indices).symmetric_difference(set(true_nearest_point_indices)))==0
     # print(f'\ntrue nearest {k} point indices2: {true_nearest_point_indices2}')
 
+def test_knn_batch():
+    print('\nbatch query test')
+    np.random.seed(0)
+    points = np.random.rand(1000, 3).astype(np.float32)
+    query_points = np.random.rand(200, 3).astype(np.float32)
+    k = 5
+    kdtree = XKDTree(points, 10)
+    nearest_point_indices = kdtree.knn_batch(query_points, k)
+    assert nearest_point_indices.shape == (200, k)
+
+    # the result should be the same with single point query
+    for i in range(query_points.shape[0]):
+        np.testing.assert_array_equal(
+            nearest_point_indices[i, :], kdtree.knn(query_points[i, :], k))
+
+    nearest_point_indices, squared_distances = \
+        kdtree.knn_batch_with_squared_distances(query_points, k, thread_num=2)
+    tree = KDTree(points)
+    true_distances, true_nearest_point_indices = tree.query(query_points, k=k)
+    for i in range(query_points.shape[0]):
+        assert set(nearest_point_indices[i, :]) == set(true_nearest_point_indices[i, :])
+    np.testing.assert_allclose(np.sort(squared_distances, axis=1), 
+                                true_distances**2, rtol=1e-4, atol=1e-6)
+
+def test_parallel_build():
+    print('\nparallel build test')
+    np.random.seed(5)
+    # the subtrees of more than 2^15 points are built in parallel, 
+    # the first two levels are split with 4 threads.
+    points = np.random.rand(150000, 3).astype(np.float32)
+    query_points = np.random.rand(200, 3).astype(np.float32)
+    kdtree = XKDTree(points, 10, thread_num=4)
+    nearest_point_indices = kdtree.knn_batch(query_points, 5)
+    _, true_nearest_point_indices = KDTree(points).query(query_points, k=5)
+    for i in range(query_points.shape[0]):
+        assert set(nearest_point_indices[i, :]) == set(true_nearest_point_indices[i, :])
+    # the tree does not depend on the number of threads
+    assert pickle.dumps(kdtree) == pickle.dumps(XKDTree(points, 10, thread_num=1))
+
+def test_radius_search():
+    print('\nradius search test')
+    np.random.seed(1)
+    points = np.random.rand(1000, 3).astype(np.float32)
+    query_points = np.random.rand(50, 3).astype(np.float32)
+    radius = 0.1
+    kdtree = XKDTree(points, 10)
+    tree = KDTree(points)
+
+    true_neighbors = tree.query_ball_point(query_points, radius)
+    for i in range(query_points.shape[0]):
+        neighbors = kdtree.radius_search(query_points[i, :], radius)
+        assert set(neighbors) == set(true_neighbors[i])
+        neighbors, squared_distances = kdtree.radius_search_with_squared_distances(
+                                                        query_points[i, :], radius)
+        np.testing.assert_array_equal(neighbors, kdtree.radius_search(query_points[i, :], radius))
+        np.testing.assert_allclose(squared_distances, 
+                np.sum((points[neighbors, :] - query_points[i, :])**2, axis=1), 
+                rtol=1e-5, atol=1e-7)
+
+    counts = kdtree.radius_count(query_points, radius)
+    np.testing.assert_array_equal(counts, [len(n) for n in true_neighbors])
+
+def test_knn_approximate():
+    print('\napproximate knn test')
+    np.random.seed(2)
+    points = np.random.rand(2000, 3).astype(np.float32)
+    kdtree = XKDTree(points, 10)
+    query_point = np.random.rand(3).astype(np.float32)
+    k = 5
+
+    # no error and no leaf limit is the same with exact search
+    nearest_point_indices, leaf_num = kdtree.knn_approximate(query_point, k)
+    np.testing.assert_array_equal(nearest_point_indices, kdtree.knn(query_point, k))
+    assert leaf_num > 1
+
+    # the distance error is bounded by epsilon
+    epsilon = 0.5
+    nearest_point_indices, approximate_leaf_num = kdtree.knn_approximate(
+                                                    query_point, 1, epsilon)
+    assert approximate_leaf_num <= leaf_num
+    exact_distance = np.linalg.norm(points[kdtree.knn(query_point, 1)[0]] - query_point)
+    distance = np.linalg.norm(points[nearest_point_indices[0]] - query_point)
+    assert distance <= exact_distance * (1 + epsilon) + 1e-6
+
+    # only scan the first leaf
+    _, leaf_num = kdtree.knn_approximate(query_point, 1, 0., 1)
+    assert leaf_num == 1
+
+def test_dual_tree_nearest_neighbors():
+    print('\ndual tree nearest neighbor test')
+    np.random.seed(0)
+    points = np.random.rand(5000, 3).astype(np.float32)
+    query_points = np.random.rand(3000, 3).astype(np.float32)
+    kdtree = XKDTree(points, 10)
+    query_kdtree = XKDTree(query_points, 10)
+    nearest_point_indices, squared_distances = \
+        kdtree.dual_tree_nearest_neighbors(query_kdtree)
+    assert nearest_point_indices.shape == (3000,)
+
+    tree = KDTree(points)
+    true_distances, _ = tree.query(query_points, k=1)
+    np.testing.assert_allclose(squared_distances, true_distances**2, 
+                                rtol=1e-4, atol=1e-6)
+    # the returned indices should be consistent with the distances
+    distances = np.sum((points[nearest_point_indices, :] - query_points)**2, axis=1)
+    np.testing.assert_allclose(distances, squared_distances, rtol=1e-4, atol=1e-6)
+
+def test_save_and_memory_map():
+    print('\nsave and memory map test')
+    np.random.seed(3)
+    points = np.random.rand(1000, 3).astype(np.float32)
+    query_points = np.random.rand(50, 3).astype(np.float32)
+    kdtree = XKDTree(points, 10)
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        file_name = os.path.join(tmp_dir, 'kd_tree.bin')
+        kdtree.save(file_name)
+
+        kdtree2 = XKDTree(file_name)
+        np.testing.assert_array_equal(kdtree.knn_batch(query_points, 3), 
+                                      kdtree2.knn_batch(query_points, 3))
+        # the pickle state is the same binary format
+        kdtree3 = pickle.loads(pickle.dumps(kdtree))
+        np.testing.assert_array_equal(kdtree.knn_batch(query_points, 3), 
+                                      kdtree3.knn_batch(query_points, 3))
+
+        with open(file_name, 'rb') as f:
+            data = f.read()
+        # the mapped file is kept intact, the corrupted copies are written to another file
+        corrupted_file_name = os.path.join(tmp_dir, 'corrupted.bin')
+        # a truncated file
+        with open(corrupted_file_name, 'wb') as f:
+            f.write(data[:len(data)//2])
+        with pytest.raises(RuntimeError):
+            XKDTree(corrupted_file_name)
+        # the points section is out of the tree, the offset is after 
+        # magic, version, leaf size, point number, node number, bounding box, 
+        # nodes offset and point indices offset.
+        with open(corrupted_file_name, 'wb') as f:
+            f.write(data[:64] + struct.pack('<Q', len(data) - 64) + data[72:])
+        with pytest.raises(RuntimeError):
+            XKDTree(corrupted_file_name)
+        # the right child of root node is out of the nodes. 
+        # the nodes start from the first aligned offset after the 80 bytes header.
+        root = struct.unpack('<I', data[128:132])[0]
+        with open(corrupted_file_name, 'wb') as f:
+            f.write(data[:128] + struct.pack('<I', root | 0x3FFFFFFF) + data[132:])
+        with pytest.raises(RuntimeError):
+            XKDTree(corrupted_file_name)
+
 if __name__ == '__main__':
     test_large_fake_array()
+    test_knn_batch()
+    test_parallel_build()
+    test_radius_search()
+    test_knn_approximate()
+    test_dual_tree_nearest_neighbors()
+    test_save_and_memory_map()